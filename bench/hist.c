@@ -0,0 +1,69 @@
+#include <stdint.h>
+
+#include "hist.h"
+
+static int
+histindex(uint64_t v)
+{
+	int s;
+
+	if(v < NSUB)
+		return v;
+	s = 63 - __builtin_clzll(v) - SUBBITS + 1;
+	if(s > MAXBITS-SUBBITS+1)
+		return NBUCKET-1;
+	return NSUB + (s-1)*(NSUB/2) + (v>>s) - NSUB/2;
+}
+
+/* midpoint of bucket i */
+static uint64_t
+histvalue(int i)
+{
+	int s;
+
+	if(i < NSUB)
+		return i;
+	i -= NSUB;
+	s = i/(NSUB/2) + 1;
+	return ((uint64_t)(i%(NSUB/2) + NSUB/2) << s) + ((uint64_t)1 << (s-1));
+}
+
+void
+histadd(Hist *h, uint64_t v)
+{
+	uint64_t m;
+
+	__atomic_add_fetch(&h->count[histindex(v)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->n, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, v, __ATOMIC_RELAXED);
+	m = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while(v > m && !__atomic_compare_exchange_n(&h->max, &m, v, 1,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+double
+histpct(Hist *h, double q)
+{
+	uint64_t want, seen;
+	int i;
+
+	if(h->n == 0)
+		return 0;
+	want = q*h->n + 0.5;
+	if(want < 1)
+		want = 1;
+	seen = 0;
+	for(i=0; i<NBUCKET; i++){
+		seen += h->count[i];
+		if(seen >= want)
+			return histvalue(i) < h->max ? histvalue(i) : h->max;
+	}
+	return h->max;
+}
+
+double
+histmean(Hist *h)
+{
+	return h->n ? (double)h->sum/h->n : 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * HDR-style latency histogram: values below NSUB are counted exactly,
+ * above that each power of two is split into NSUB/2 linear buckets, so
+ * every bucket is within 1/128 of its value. Values are nanoseconds;
+ * anything past 2^MAXBITS (about 18 minutes) lands in the last bucket.
+ * histadd() is atomic, so one Hist can be shared by every thread.
+ */
+enum
+{
+	SUBBITS = 8,
+	NSUB = 1<<SUBBITS,
+	MAXBITS = 40,
+	NBUCKET = NSUB + (MAXBITS-SUBBITS+1)*(NSUB/2),
+};
+
+typedef struct Hist Hist;
+
+struct Hist
+{
+	uint64_t	n;
+	uint64_t	sum;
+	uint64_t	max;
+	uint64_t	count[NBUCKET];
+};
+
+void	histadd(Hist*, uint64_t);
+double	histpct(Hist*, double q);
+double	histmean(Hist*);
@@ -0,0 +1,545 @@
+/*
+ * Loopback I/O macrobenchmark. A child process runs a taskmn echo or
+ * HTTP server; the parent drives it with -c connections, each keeping
+ * up to -p requests in flight, and prints one JSON object with the
+ * throughput and latency percentiles:
+ *
+ *	{"bench":"echo","conns":16,"pipeline":1,"rate":0,"size":64,
+ *	 "sthreads":1,"cthreads":1,"secs":5.000,"requests":812345,
+ *	 "rps":162469.0,"meanus":97.9,"p50us":95.0,"p90us":110.0,
+ *	 "p99us":180.0,"p999us":410.0,"maxus":2100.0,"lost":0,
+ *	 "lagp99us":0.0}
+ *
+ * With -r rate the load is open loop: every connection sends on a fixed
+ * schedule (rate/conns per second) whether or not earlier replies have
+ * come back, and latency is measured from when a request was due, not
+ * from when it was actually written. A stalled server therefore shows up
+ * in the tail instead of quietly slowing the generator down (coordinated
+ * omission). lagp99us is how late the generator itself was sending; if
+ * it is large, the client is the bottleneck, so give it more threads.
+ * Without -r, each connection sends as soon as it has a free slot.
+ *
+ * -a host:port drives an existing server instead of forking one.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <taskmn.h>
+
+#include "hist.h"
+
+enum
+{
+	ECHO,
+	HTTP,
+	BUFSIZE = 64*1024,
+};
+
+typedef struct Cfg Cfg;
+typedef struct Conn Conn;
+
+struct Cfg
+{
+	int	mode;
+	int	conns;
+	int	pipeline;
+	double	rate;	/* total requests/s, 0 for closed loop */
+	int	size;	/* echo message or HTTP body bytes */
+	int	sthreads;
+	int	cthreads;
+	double	secs;
+	double	warmup;
+	char	*host;
+	int	port;
+	int	ready;	/* server: write end of the port pipe */
+
+	uint64_t	start;	/* recording begins (after warmup) */
+	uint64_t	end;	/* sending stops */
+	long	nlost;
+	int	failed;
+	Hist	lat;
+	Hist	lag;
+	WaitGroup wg;
+};
+
+struct Conn
+{
+	Cfg	*cfg;
+	int	fd;
+	int	id;
+	Rendez	rz;
+	int	inflight;
+	int	head;
+	uint64_t	*due;	/* ring of pipeline due times */
+};
+
+static char *modename[] = { "echo", "http" };
+static char httpreq[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/* server */
+
+static char*
+findhdr(char *p, char *e)
+{
+	for(; p+4 <= e; p++)
+		if(p[0]=='\r' && p[1]=='\n' && p[2]=='\r' && p[3]=='\n')
+			return p+4;
+	return NULL;
+}
+
+static void
+echoserve(Task *t, int fd)
+{
+	char *buf;
+	ssize_t n;
+
+	buf = malloc(BUFSIZE);
+	while((n = fdread(t, fd, buf, BUFSIZE)) > 0)
+		if(fdwrite(t, fd, buf, n) != n)
+			break;
+	free(buf);
+}
+
+/* answer every complete request in a read with one write */
+static void
+httpserve(Task *t, int fd, Cfg *cfg)
+{
+	char *in, *out, *body, *p, *q, *e;
+	int hlen, m, nout, room;
+	ssize_t n;
+
+	in = malloc(BUFSIZE);
+	body = malloc(cfg->size);
+	memset(body, 'x', cfg->size);
+	room = BUFSIZE;
+	out = malloc(room);
+	m = 0;
+	while((n = fdread(t, fd, in+m, BUFSIZE-m)) > 0){
+		m += n;
+		e = in+m;
+		nout = 0;
+		for(p=in; (q = findhdr(p, e)) != NULL; p=q){
+			if(nout + 128 + cfg->size > room){
+				room = 2*(nout + 128 + cfg->size);
+				out = realloc(out, room);
+			}
+			hlen = sprintf(out+nout, "HTTP/1.1 200 OK\r\n"
+			    "Content-Length: %d\r\n\r\n", cfg->size);
+			memmove(out+nout+hlen, body, cfg->size);
+			nout += hlen + cfg->size;
+		}
+		m = e - p;
+		memmove(in, p, m);
+		if(m == BUFSIZE)	/* not HTTP */
+			break;
+		if(nout > 0 && fdwrite(t, fd, out, nout) != nout)
+			break;
+	}
+	free(in);
+	free(out);
+	free(body);
+}
+
+static void
+servetask(Task *t, void *v)
+{
+	Conn *c = v;
+
+	taskname(t, "serve %d", c->fd);
+	if(c->cfg->mode == ECHO)
+		echoserve(t, c->fd);
+	else
+		httpserve(t, c->fd, c->cfg);
+	close(c->fd);
+	free(c);
+}
+
+static void
+servermain(Task *t, void *v)
+{
+	Cfg *cfg = v;
+	struct sockaddr_in sa;
+	socklen_t sn;
+	Conn *c;
+	int fd, cfd;
+
+	fd = netannounce(t, TCP, "127.0.0.1", 0);
+	if(fd < 0){
+		perror("netannounce");
+		exit(1);
+	}
+	sn = sizeof sa;
+	getsockname(fd, (struct sockaddr*)&sa, &sn);
+	cfg->port = ntohs(sa.sin_port);
+	if(write(cfg->ready, &cfg->port, sizeof cfg->port) != sizeof cfg->port)
+		exit(1);
+	close(cfg->ready);
+
+	while((cfd = netaccept(t, fd)) >= 0){
+		c = calloc(1, sizeof *c);
+		c->cfg = cfg;
+		c->fd = cfd;
+		taskcreate(t, servetask, c);
+	}
+	perror("netaccept");
+	exit(1);
+}
+
+/* client */
+
+static int
+request(Conn *c, char *buf)
+{
+	if(c->cfg->mode == HTTP){
+		strcpy(buf, httpreq);
+		return strlen(httpreq);
+	}
+	memset(buf, 'e', c->cfg->size);
+	return c->cfg->size;
+}
+
+/* sleep until the monotonic clock reaches when */
+static void
+sleepuntil(Task *t, int tfd, uint64_t when)
+{
+	uint64_t n;
+#ifdef __linux__
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = when / 1000000000;
+	its.it_value.tv_nsec = when % 1000000000;
+	if(timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) == 0){
+		fdwait(t, tfd, 'r');
+		while(read(tfd, &n, sizeof n) < 0 && errno == EINTR)
+			;
+		return;
+	}
+#endif
+	n = now();
+	if(when > n)
+		taskdelay(t, (when - n + 999999)/1000000);
+}
+
+static void
+sendtask(Task *t, void *v)
+{
+	Conn *c = v;
+	Cfg *cfg = c->cfg;
+	char *buf;
+	uint64_t due, step, tnow;
+	int len, tfd;
+
+	taskname(t, "send %d", c->id);
+	buf = malloc(cfg->size > (int)sizeof httpreq ? cfg->size : sizeof httpreq);
+	len = request(c, buf);
+	tfd = -1;
+	step = 0;
+	due = cfg->start - (uint64_t)(cfg->warmup*1e9);
+	if(cfg->rate > 0){
+		step = cfg->conns*1e9/cfg->rate;
+		due += step*c->id/cfg->conns;	/* spread connections out */
+#ifdef __linux__
+		tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+#endif
+	}
+
+	for(;;){
+		tnow = now();
+		if(cfg->rate == 0)
+			due = tnow;
+		if(due >= cfg->end)
+			break;
+		if(due > tnow){
+			sleepuntil(t, tfd, due);
+			continue;
+		}
+		pthread_mutex_lock(&c->rz.l);
+		while(c->inflight == cfg->pipeline)
+			tasksleep(t, &c->rz);
+		if(cfg->rate == 0)
+			due = now();
+		c->due[(c->head + c->inflight) % cfg->pipeline] = due;
+		c->inflight++;
+		pthread_mutex_unlock(&c->rz.l);
+
+		if(due >= cfg->start)
+			histadd(&cfg->lag, now() - due);
+		if(fdwrite(t, c->fd, buf, len) != len)
+			break;
+		due += step;
+	}
+
+	/* the server closes when it sees EOF, which ends recvtask */
+	shutdown(c->fd, SHUT_WR);
+	if(tfd >= 0)
+		close(tfd);
+	free(buf);
+	wgdone(&cfg->wg);
+}
+
+/* length of the first complete response in p[0:n], or 0 */
+static int
+response(Cfg *cfg, char *p, int n)
+{
+	char *e, *q;
+	int len;
+
+	if(cfg->mode == ECHO)
+		return n >= cfg->size ? cfg->size : 0;
+	if((e = findhdr(p, p+n)) == NULL)
+		return 0;
+	len = 0;
+	for(q=p; q<e; q++){
+		if(strncasecmp(q, "\nContent-Length:", 16) == 0){
+			len = atoi(q+16);
+			break;
+		}
+	}
+	if(e-p + len > n)
+		return 0;
+	return e-p + len;
+}
+
+static void
+recvtask(Task *t, void *v)
+{
+	Conn *c = v;
+	Cfg *cfg = c->cfg;
+	char *buf;
+	uint64_t due;
+	ssize_t n;
+	int m, len;
+
+	taskname(t, "recv %d", c->id);
+	buf = malloc(BUFSIZE);
+	m = 0;
+	while((n = fdread(t, c->fd, buf+m, BUFSIZE-m)) > 0){
+		m += n;
+		while((len = response(cfg, buf, m)) > 0){
+			pthread_mutex_lock(&c->rz.l);
+			if(c->inflight == 0){
+				pthread_mutex_unlock(&c->rz.l);
+				fprintf(stderr, "netbench: unsolicited response\n");
+				cfg->failed = 1;
+				goto out;
+			}
+			due = c->due[c->head];
+			c->head = (c->head + 1) % cfg->pipeline;
+			c->inflight--;
+			taskwakeup(&c->rz);
+			pthread_mutex_unlock(&c->rz.l);
+
+			if(due >= cfg->start)
+				histadd(&cfg->lat, now() - due);
+			m -= len;
+			memmove(buf, buf+len, m);
+		}
+		if(m == BUFSIZE){
+			fprintf(stderr, "netbench: response too large\n");
+			cfg->failed = 1;
+			break;
+		}
+	}
+out:
+	__atomic_add_fetch(&cfg->nlost, c->inflight, __ATOMIC_RELAXED);
+	free(buf);
+	wgdone(&cfg->wg);
+}
+
+static void
+clientmain(Task *t, void *v)
+{
+	Cfg *cfg = v;
+	Conn *c;
+	int i, one;
+
+	c = calloc(cfg->conns, sizeof c[0]);
+	for(i=0; i<cfg->conns; i++){
+		c[i].cfg = cfg;
+		c[i].id = i;
+		rendezinit(&c[i].rz);
+		c[i].due = calloc(cfg->pipeline, sizeof c[i].due[0]);
+		c[i].fd = netdial(t, TCP, cfg->host, cfg->port);
+		if(c[i].fd < 0){
+			fprintf(stderr, "netbench: dial %s:%d: %s\n",
+			    cfg->host, cfg->port, strerror(errno));
+			exit(1);
+		}
+		one = 1;
+		setsockopt(c[i].fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	}
+
+	cfg->start = now() + (uint64_t)(cfg->warmup*1e9);
+	cfg->end = cfg->start + (uint64_t)(cfg->secs*1e9);
+	wgadd(&cfg->wg, 2*cfg->conns);
+	for(i=0; i<cfg->conns; i++){
+		taskcreate(t, recvtask, &c[i]);
+		taskcreate(t, sendtask, &c[i]);
+	}
+	wgwait(t, &cfg->wg);
+
+	for(i=0; i<cfg->conns; i++){
+		close(c[i].fd);
+		free(c[i].due);
+	}
+	free(c);
+}
+
+static void
+report(Cfg *cfg)
+{
+	Hist *h = &cfg->lat;
+
+	printf("{\"bench\":\"%s\",\"conns\":%d,\"pipeline\":%d,\"rate\":%.0f,"
+	    "\"size\":%d,\"sthreads\":%d,\"cthreads\":%d,\"secs\":%.3f,"
+	    "\"requests\":%llu,\"rps\":%.1f,\"meanus\":%.1f,"
+	    "\"p50us\":%.1f,\"p90us\":%.1f,\"p99us\":%.1f,\"p999us\":%.1f,"
+	    "\"maxus\":%.1f,\"lost\":%ld,\"lagp99us\":%.1f}\n",
+	    modename[cfg->mode], cfg->conns, cfg->pipeline, cfg->rate,
+	    cfg->size, cfg->host ? 0 : cfg->sthreads, cfg->cthreads, cfg->secs,
+	    (unsigned long long)h->n, h->n/cfg->secs,
+	    histmean(h)/1e3,
+	    histpct(h, 0.5)/1e3, histpct(h, 0.9)/1e3, histpct(h, 0.99)/1e3,
+	    histpct(h, 0.999)/1e3, h->max/1e3, cfg->nlost,
+	    histpct(&cfg->lag, 0.99)/1e3);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: netbench [-m echo|http] [-c conns] "
+	    "[-p pipeline] [-r rate] [-z size]\n"
+	    "\t[-d secs] [-w warmup] [-n serverthreads] [-T clientthreads] "
+	    "[-a host:port]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	Cfg *cfg;
+	pid_t pid;
+	char *p;
+	int c, fd[2], status;
+
+	cfg = calloc(1, sizeof *cfg);
+	cfg->mode = ECHO;
+	cfg->conns = 16;
+	cfg->pipeline = 1;
+	cfg->size = 64;
+	cfg->sthreads = 1;
+	cfg->cthreads = 1;
+	cfg->secs = 5;
+	cfg->warmup = 1;
+	while((c = getopt(argc, argv, "a:c:d:m:n:p:r:T:w:z:")) != -1){
+		switch(c){
+		case 'a':
+			cfg->host = optarg;
+			if((p = strrchr(optarg, ':')) == NULL)
+				usage();
+			*p = '\0';
+			cfg->port = atoi(p+1);
+			break;
+		case 'c':
+			cfg->conns = atoi(optarg);
+			break;
+		case 'd':
+			cfg->secs = atof(optarg);
+			break;
+		case 'm':
+			if(strcmp(optarg, "echo") == 0)
+				cfg->mode = ECHO;
+			else if(strcmp(optarg, "http") == 0)
+				cfg->mode = HTTP;
+			else
+				usage();
+			break;
+		case 'n':
+			cfg->sthreads = atoi(optarg);
+			break;
+		case 'p':
+			cfg->pipeline = atoi(optarg);
+			break;
+		case 'r':
+			cfg->rate = atof(optarg);
+			break;
+		case 'T':
+			cfg->cthreads = atoi(optarg);
+			break;
+		case 'w':
+			cfg->warmup = atof(optarg);
+			break;
+		case 'z':
+			cfg->size = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if(optind != argc || cfg->conns < 1 || cfg->pipeline < 1 ||
+	    cfg->size < 1 || cfg->size > BUFSIZE/2 || cfg->secs <= 0 ||
+	    cfg->warmup < 0 || cfg->rate < 0 || cfg->sthreads < 1 ||
+	    cfg->cthreads < 1)
+		usage();
+	signal(SIGPIPE, SIG_IGN);
+
+	pid = -1;
+	if(cfg->host == NULL){
+		if(pipe(fd) < 0){
+			perror("pipe");
+			exit(1);
+		}
+		pid = fork();
+		if(pid < 0){
+			perror("fork");
+			exit(1);
+		}
+		if(pid == 0){
+			close(fd[0]);
+			cfg->ready = fd[1];
+			exit(libtaskmn(servermain, cfg, cfg->sthreads));
+		}
+		close(fd[1]);
+		if(read(fd[0], &cfg->port, sizeof cfg->port) != sizeof cfg->port){
+			fprintf(stderr, "netbench: server failed to start\n");
+			exit(1);
+		}
+		close(fd[0]);
+		cfg->host = "127.0.0.1";
+	}
+
+	libtaskmn(clientmain, cfg, cfg->cthreads);
+	if(pid > 0){
+		kill(pid, SIGTERM);
+		waitpid(pid, &status, 0);
+		cfg->host = NULL;
+	}
+	report(cfg);
+	return cfg->failed;
+}
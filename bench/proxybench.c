@@ -0,0 +1,409 @@
+/*
+ * tcpproxy benchmark. The parent runs demo/tcpproxy.c's relay, which
+ * lives in demo/relay.c, on a taskmn pool of -n workers with -b byte
+ * buffers. A forked load process opens -c streams through it with plain
+ * blocking threads: a source thread per stream writes -z byte messages
+ * stamped with the time they were due (as fast as possible, or -r per
+ * second over all streams, as in netbench), and a sink behind the proxy
+ * reads them back and records the relay latency. After -d seconds it
+ * prints one JSON object:
+ *
+ *	{"bench":"proxy","streams":16,"size":1024,"bufsize":2048,
+ *	 "threads":1,"rate":0,"secs":5.002,"bytes":3355443200,
+ *	 "mibps":639.7,"msgs":3276800,"meanus":...,"p50us":...,
+ *	 "p99us":...,"p999us":...,"maxus":...,"cswpermib":1.9,
+ *	 "taskswpermib":130.2,"cpusecpergib":1.41}
+ *
+ * cswpermib is kernel context switches of the proxy process per MiB
+ * relayed, taskswpermib is task dispatches per MiB, and cpusecpergib is
+ * user+system CPU seconds the proxy process burned per GiB. Only the
+ * proxy process is counted; the load process runs on its own.
+ */
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <taskmn.h>
+
+#include "hist.h"
+#include "relay.h"
+
+typedef struct Cfg Cfg;
+typedef struct Result Result;
+
+struct Cfg
+{
+	int	streams;
+	int	size;
+	int	bufsize;
+	int	nthr;
+	double	rate;	/* total messages/s, 0 for flat out */
+	double	secs;
+	int	sinkport;
+	int	proxyport;
+	int	tochild[2];
+	int	toparent[2];
+
+	/* load process */
+	uint64_t	end;
+	pthread_barrier_t	ready;
+	Hist	lat;
+	uint64_t	bytes;
+};
+
+/* what the load process reports back */
+struct Result
+{
+	uint64_t	bytes;
+	uint64_t	msgs;
+	double	secs;
+	double	mean;
+	double	p50;
+	double	p99;
+	double	p999;
+	double	max;
+};
+
+static Cfg cfg;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void
+fatal(char *what)
+{
+	fprintf(stderr, "proxybench: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+/* proxy; the relay itself is demo/relay.c */
+
+static void
+proxytask(Task *t, void *v)
+{
+	int fd, remotefd;
+
+	fd = (intptr_t)v;
+	if((remotefd = netdial(t, TCP, "127.0.0.1", cfg.sinkport)) < 0){
+		close(fd);
+		return;
+	}
+	relaystart(t, fd, remotefd, cfg.bufsize);
+}
+
+static void
+accepttask(Task *t, void *v)
+{
+	int fd, cfd;
+
+	fd = (intptr_t)v;
+	while((cfd = netaccept(t, fd)) >= 0)
+		taskcreate(t, proxytask, (void*)(intptr_t)cfd);
+}
+
+static int
+readfull(Task *t, int fd, void *buf, int n)
+{
+	ssize_t m;
+	int tot;
+
+	for(tot=0; tot<n; tot+=m)
+		if((m = fdread(t, fd, (char*)buf+tot, n-tot)) <= 0)
+			return -1;
+	return 0;
+}
+
+static void
+proxymain(Task *t, void *v)
+{
+	struct sockaddr_in sa;
+	struct rusage ru0, ru1;
+	Poolstat ps0, ps1;
+	Result res;
+	socklen_t sn;
+	double mib, cpu;
+	char c;
+	int fd;
+
+	fd = netannounce(t, TCP, "127.0.0.1", 0);
+	if(fd < 0)
+		fatal("netannounce");
+	sn = sizeof sa;
+	getsockname(fd, (struct sockaddr*)&sa, &sn);
+	cfg.proxyport = ntohs(sa.sin_port);
+	if(write(cfg.tochild[1], &cfg.proxyport, sizeof cfg.proxyport) < 0)
+		fatal("write");
+	taskcreate(t, accepttask, (void*)(intptr_t)fd);
+
+	fdnoblock(cfg.toparent[0]);
+	if(readfull(t, cfg.toparent[0], &c, 1) < 0)
+		exit(1);
+	getrusage(RUSAGE_SELF, &ru0);
+	taskpoolstat(t, &ps0);
+	if(readfull(t, cfg.toparent[0], &res, sizeof res) < 0)
+		exit(1);
+	getrusage(RUSAGE_SELF, &ru1);
+	taskpoolstat(t, &ps1);
+
+	mib = res.bytes / (1024.0*1024);
+	cpu = ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec +
+	    ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec +
+	    (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec +
+	    ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec)/1e6;
+	if(mib == 0)
+		mib = 1e-9;
+	printf("{\"bench\":\"proxy\",\"streams\":%d,\"size\":%d,\"bufsize\":%d,"
+	    "\"threads\":%d,\"rate\":%.0f,\"secs\":%.3f,\"bytes\":%llu,"
+	    "\"mibps\":%.1f,\"msgs\":%llu,\"meanus\":%.1f,\"p50us\":%.1f,"
+	    "\"p99us\":%.1f,\"p999us\":%.1f,\"maxus\":%.1f,"
+	    "\"cswpermib\":%.2f,\"taskswpermib\":%.2f,\"cpusecpergib\":%.3f}\n",
+	    cfg.streams, cfg.size, cfg.bufsize, cfg.nthr, cfg.rate, res.secs,
+	    (unsigned long long)res.bytes, mib/res.secs,
+	    (unsigned long long)res.msgs, res.mean/1e3, res.p50/1e3,
+	    res.p99/1e3, res.p999/1e3, res.max/1e3,
+	    (ru1.ru_nvcsw - ru0.ru_nvcsw + ru1.ru_nivcsw - ru0.ru_nivcsw)/mib,
+	    (ps1.ndispatch - ps0.ndispatch)/mib, cpu/(mib/1024));
+	fflush(stdout);
+	exit(0);	/* the accept and relay tasks never finish */
+}
+
+/* load process */
+
+static int
+writefull(int fd, void *buf, int n)
+{
+	ssize_t m;
+	int tot;
+
+	for(tot=0; tot<n; tot+=m){
+		if((m = write(fd, (char*)buf+tot, n-tot)) < 0 && errno == EINTR)
+			m = 0;
+		else if(m <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void*
+source(void *v)
+{
+	struct sockaddr_in sa;
+	struct timespec ts;
+	uint64_t due, step;
+	char *msg;
+	int fd, one;
+
+	msg = calloc(1, cfg.size);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(cfg.proxyport);
+	if(fd < 0 || connect(fd, (struct sockaddr*)&sa, sizeof sa) < 0)
+		fatal("connect");
+	one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	pthread_barrier_wait(&cfg.ready);
+
+	step = cfg.rate > 0 ? cfg.streams*1e9/cfg.rate : 0;
+	due = now() + step*(intptr_t)v/cfg.streams;	/* spread streams out */
+	while(due < cfg.end){
+		if(step){
+			ts.tv_sec = due / 1000000000;
+			ts.tv_nsec = due % 1000000000;
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+				;
+		}else
+			due = now();
+		memmove(msg, &due, sizeof due);
+		if(writefull(fd, msg, cfg.size) < 0)
+			break;
+		due += step;
+	}
+	shutdown(fd, SHUT_WR);
+	while(read(fd, msg, cfg.size) > 0)	/* wait for the proxy to let go */
+		;
+	close(fd);
+	free(msg);
+	return NULL;
+}
+
+static void*
+sink(void *v)
+{
+	uint64_t stamp, bytes;
+	char *msg;
+	ssize_t m;
+	int fd, got;
+
+	fd = (intptr_t)v;
+	msg = malloc(cfg.size);
+	bytes = 0;
+	for(got=0;; got+=m){
+		if(got == cfg.size){
+			memmove(&stamp, msg, sizeof stamp);
+			histadd(&cfg.lat, now() - stamp);
+			bytes += got;
+			got = 0;
+		}
+		m = read(fd, msg+got, cfg.size-got);
+		if(m < 0 && errno == EINTR)
+			m = 0;
+		else if(m <= 0)
+			break;
+	}
+	__atomic_add_fetch(&cfg.bytes, bytes, __ATOMIC_RELAXED);
+	close(fd);
+	free(msg);
+	return NULL;
+}
+
+static void
+load(int lfd)
+{
+	pthread_t *src, *snk;
+	Result res;
+	uint64_t t0;
+	int i, fd;
+
+	if(read(cfg.tochild[0], &cfg.proxyport, sizeof cfg.proxyport) != sizeof cfg.proxyport)
+		exit(1);
+	src = malloc(cfg.streams * sizeof src[0]);
+	snk = malloc(cfg.streams * sizeof snk[0]);
+	pthread_barrier_init(&cfg.ready, NULL, cfg.streams+1);
+	cfg.end = ~0ULL;
+	for(i=0; i<cfg.streams; i++)
+		if(pthread_create(&src[i], NULL, source, (void*)(intptr_t)i) != 0)
+			fatal("pthread_create");
+	for(i=0; i<cfg.streams; i++){
+		if((fd = accept(lfd, NULL, NULL)) < 0)
+			fatal("accept");
+		if(pthread_create(&snk[i], NULL, sink, (void*)(intptr_t)fd) != 0)
+			fatal("pthread_create");
+	}
+	t0 = now();
+	cfg.end = t0 + cfg.secs*1e9;
+	pthread_barrier_wait(&cfg.ready);
+	if(writefull(cfg.toparent[1], "s", 1) < 0)
+		exit(1);
+
+	for(i=0; i<cfg.streams; i++)
+		pthread_join(src[i], NULL);
+	for(i=0; i<cfg.streams; i++)
+		pthread_join(snk[i], NULL);
+
+	memset(&res, 0, sizeof res);
+	res.secs = (now() - t0)/1e9;
+	res.bytes = cfg.bytes;
+	res.msgs = cfg.lat.n;
+	res.mean = histmean(&cfg.lat);
+	res.p50 = histpct(&cfg.lat, 0.5);
+	res.p99 = histpct(&cfg.lat, 0.99);
+	res.p999 = histpct(&cfg.lat, 0.999);
+	res.max = cfg.lat.max;
+	if(writefull(cfg.toparent[1], &res, sizeof res) < 0)
+		exit(1);
+	exit(0);
+}
+
+static int
+listener(void)
+{
+	struct sockaddr_in sa;
+	socklen_t sn;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(fd < 0 || bind(fd, (struct sockaddr*)&sa, sizeof sa) < 0 ||
+	    listen(fd, SOMAXCONN) < 0)
+		fatal("listen");
+	sn = sizeof sa;
+	getsockname(fd, (struct sockaddr*)&sa, &sn);
+	cfg.sinkport = ntohs(sa.sin_port);
+	return fd;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: proxybench [-c streams] [-z msgsize] "
+	    "[-b bufsize] [-n threads] [-r rate] [-d secs]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	pid_t pid;
+	int c, lfd, status;
+
+	cfg.streams = 16;
+	cfg.size = 1024;
+	cfg.bufsize = 2048;
+	cfg.nthr = 1;
+	cfg.secs = 5;
+	while((c = getopt(argc, argv, "b:c:d:n:r:z:")) != -1){
+		switch(c){
+		case 'b':
+			cfg.bufsize = atoi(optarg);
+			break;
+		case 'c':
+			cfg.streams = atoi(optarg);
+			break;
+		case 'd':
+			cfg.secs = atof(optarg);
+			break;
+		case 'n':
+			cfg.nthr = atoi(optarg);
+			break;
+		case 'r':
+			cfg.rate = atof(optarg);
+			break;
+		case 'z':
+			cfg.size = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if(optind != argc || cfg.streams < 1 || cfg.size < (int)sizeof(uint64_t) ||
+	    cfg.bufsize < 1 || cfg.nthr < 1 || cfg.rate < 0 || cfg.secs <= 0)
+		usage();
+	signal(SIGPIPE, SIG_IGN);
+
+	lfd = listener();
+	if(pipe(cfg.tochild) < 0 || pipe(cfg.toparent) < 0)
+		fatal("pipe");
+	if((pid = fork()) < 0)
+		fatal("fork");
+	if(pid == 0)
+		load(lfd);
+	close(lfd);
+
+	libtaskmn(proxymain, NULL, cfg.nthr);
+	waitpid(pid, &status, 0);
+	return 1;
+}
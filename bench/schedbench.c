@@ -0,0 +1,639 @@
+/*
+ * Scheduler microbenchmarks. Each workload runs on libtaskmn and, for
+ * comparison, on plain pthreads, at 1, 2, 4, ... up to -t worker threads.
+ * Every result is one JSON object on its own line:
+ *
+ *	{"bench":"wake","impl":"taskmn","threads":2,"ops":200000,
+ *	 "secs":0.183,"nsop":915.2}
+ *
+ * ops counts the unit named under the benchmark below, nsop is wall time
+ * per op. The delay benchmark adds p50us/p99us/maxus of timer overshoot.
+ *
+ *	yield	taskyield() with two tasks per worker; op = one yield
+ *		(pthread: sched_yield() with two threads per cpu)
+ *	create	taskcreate() of an empty task and its exit; op = one task
+ *		(pthread: pthread_create() + pthread_join())
+ *	wake	Rendez ping-pong between task pairs, one pair per worker;
+ *		op = one round trip (pthread: mutex + condvar)
+ *	delay	64 tasks per worker looping on taskdelay(1); op = one
+ *		timer firing (pthread: nanosleep() of 1ms)
+ *	pipe	one byte back and forth over two pipes with fdread() and
+ *		fdwrite(), one pair per worker; op = one round trip
+ *		(pthread: blocking read() and write())
+ */
+#include <sys/types.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <taskmn.h>
+
+#define nelem(x)	(sizeof(x)/sizeof((x)[0]))
+
+enum
+{
+	NDELAY = 64,	/* delay tasks per worker */
+	CREATEBATCH = 256,
+};
+
+typedef struct Bench Bench;
+typedef struct Run Run;
+typedef struct Pair Pair;
+typedef struct Side Side;
+
+struct Run
+{
+	Bench	*b;
+	int	nthr;
+	long	iters;	/* per task/thread/pair, scaled by -s */
+	long	ops;
+	double	secs;
+	double	*over;	/* delay: overshoot samples in µs */
+	long	nover;
+	WaitGroup wg;
+};
+
+struct Bench
+{
+	char	*name;
+	long	iters;
+	void	(*task)(Task*, void*);
+	void	(*thread)(Run*);
+};
+
+struct Pair
+{
+	Run	*r;
+	int	turn;
+	Rendez	rz;
+	pthread_mutex_t	l;
+	pthread_cond_t	c;
+	int	fd[4];	/* a->b read, a->b write, b->a read, b->a write */
+};
+
+struct Side
+{
+	Pair	*p;
+	int	me;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void
+sample(Run *r, double us)
+{
+	long i;
+
+	i = __atomic_fetch_add(&r->nover, 1, __ATOMIC_RELAXED);
+	r->over[i] = us < 0 ? 0 : us;
+}
+
+static void
+spawn(int n, void *(*fn)(void*), void *arg, size_t argsize)
+{
+	pthread_t *th;
+	int i, rc;
+
+	th = malloc(n * sizeof th[0]);
+	for(i=0; i<n; i++){
+		rc = pthread_create(&th[i], NULL, fn, (char*)arg + i*argsize);
+		if(rc != 0){
+			fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+			exit(1);
+		}
+	}
+	for(i=0; i<n; i++)
+		pthread_join(th[i], NULL);
+	free(th);
+}
+
+/* yield */
+
+static void
+yieldtask(Task *t, void *v)
+{
+	Run *r = v;
+	long i;
+
+	for(i=0; i<r->iters; i++)
+		taskyield(t);
+	wgdone(&r->wg);
+}
+
+static void
+yieldmain(Task *t, void *v)
+{
+	Run *r = v;
+	int i, n;
+	double t0;
+
+	n = 2*r->nthr;
+	t0 = now();
+	wgadd(&r->wg, n);
+	for(i=0; i<n; i++)
+		taskcreate(t, yieldtask, r);
+	wgwait(t, &r->wg);
+	r->secs = now() - t0;
+	r->ops = n*r->iters;
+}
+
+static void*
+yieldthr(void *v)
+{
+	Run *r = *(Run**)v;
+	long i;
+
+	for(i=0; i<r->iters; i++)
+		sched_yield();
+	return NULL;
+}
+
+static void
+yieldpthr(Run *r)
+{
+	Run *arg[2*r->nthr];
+	int i, n;
+	double t0;
+
+	n = nelem(arg);
+	for(i=0; i<n; i++)
+		arg[i] = r;
+	t0 = now();
+	spawn(n, yieldthr, arg, sizeof arg[0]);
+	r->secs = now() - t0;
+	r->ops = n*r->iters;
+}
+
+/* create */
+
+static void
+emptytask(Task *t, void *v)
+{
+	Run *r = v;
+
+	wgdone(&r->wg);
+}
+
+static void
+createmain(Task *t, void *v)
+{
+	Run *r = v;
+	long i, n;
+	double t0;
+
+	t0 = now();
+	for(n=0; n<r->iters; n+=CREATEBATCH){
+		wgadd(&r->wg, CREATEBATCH);
+		for(i=0; i<CREATEBATCH; i++)
+			taskcreate(t, emptytask, r);
+		wgwait(t, &r->wg);
+	}
+	r->secs = now() - t0;
+	r->ops = n;
+}
+
+static void*
+emptythr(void *v)
+{
+	return v;
+}
+
+static void
+createpthr(Run *r)
+{
+	pthread_t th[CREATEBATCH];
+	long i, n;
+	int rc;
+	double t0;
+
+	/* creation from one thread, as with the tasks above */
+	t0 = now();
+	for(n=0; n<r->iters; n+=CREATEBATCH){
+		for(i=0; i<CREATEBATCH; i++){
+			rc = pthread_create(&th[i], NULL, emptythr, r);
+			if(rc != 0){
+				fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+				exit(1);
+			}
+		}
+		for(i=0; i<CREATEBATCH; i++)
+			pthread_join(th[i], NULL);
+	}
+	r->secs = now() - t0;
+	r->ops = n;
+}
+
+/* wake */
+
+static void
+pinger(Task *t, Pair *p, int me)
+{
+	long i;
+
+	pthread_mutex_lock(&p->rz.l);
+	for(i=0; i<p->r->iters; i++){
+		while(p->turn != me)
+			tasksleep(t, &p->rz);
+		p->turn = !me;
+		taskwakeup(&p->rz);
+	}
+	pthread_mutex_unlock(&p->rz.l);
+	wgdone(&p->r->wg);
+}
+
+static void
+pingtask(Task *t, void *v)
+{
+	pinger(t, v, 0);
+}
+
+static void
+pongtask(Task *t, void *v)
+{
+	pinger(t, v, 1);
+}
+
+static void
+pairmain(Task *t, Run *r, void (*ping)(Task*, void*),
+    void (*pong)(Task*, void*))
+{
+	Pair p[r->nthr];
+	int i;
+	double t0;
+
+	memset(p, 0, sizeof p);
+	for(i=0; i<r->nthr; i++){
+		p[i].r = r;
+		rendezinit(&p[i].rz);
+		if(pipe(p[i].fd) < 0 || pipe(p[i].fd+2) < 0){
+			perror("pipe");
+			exit(1);
+		}
+		fdnoblock(p[i].fd[0]);
+		fdnoblock(p[i].fd[2]);
+	}
+	t0 = now();
+	wgadd(&r->wg, 2*r->nthr);
+	for(i=0; i<r->nthr; i++){
+		taskcreate(t, ping, &p[i]);
+		taskcreate(t, pong, &p[i]);
+	}
+	wgwait(t, &r->wg);
+	r->secs = now() - t0;
+	r->ops = r->nthr*r->iters;
+	for(i=0; i<r->nthr; i++){
+		close(p[i].fd[0]); close(p[i].fd[1]);
+		close(p[i].fd[2]); close(p[i].fd[3]);
+	}
+}
+
+static void
+wakemain(Task *t, void *v)
+{
+	pairmain(t, v, pingtask, pongtask);
+}
+
+static void
+pthrpinger(Pair *p, int me)
+{
+	long i;
+
+	pthread_mutex_lock(&p->l);
+	for(i=0; i<p->r->iters; i++){
+		while(p->turn != me)
+			pthread_cond_wait(&p->c, &p->l);
+		p->turn = !me;
+		pthread_cond_signal(&p->c);
+	}
+	pthread_mutex_unlock(&p->l);
+}
+
+static void
+pairpthr(Run *r, void *(*fn)(void*))
+{
+	Pair p[r->nthr];
+	Side arg[2*r->nthr];
+	int i;
+	double t0;
+
+	memset(p, 0, sizeof p);
+	for(i=0; i<r->nthr; i++){
+		p[i].r = r;
+		pthread_mutex_init(&p[i].l, NULL);
+		pthread_cond_init(&p[i].c, NULL);
+		if(pipe(p[i].fd) < 0 || pipe(p[i].fd+2) < 0){
+			perror("pipe");
+			exit(1);
+		}
+		arg[2*i] = (Side){ &p[i], 0 };
+		arg[2*i+1] = (Side){ &p[i], 1 };
+	}
+	t0 = now();
+	spawn(2*r->nthr, fn, arg, sizeof arg[0]);
+	r->secs = now() - t0;
+	r->ops = r->nthr*r->iters;
+	for(i=0; i<r->nthr; i++){
+		pthread_mutex_destroy(&p[i].l);
+		pthread_cond_destroy(&p[i].c);
+		close(p[i].fd[0]); close(p[i].fd[1]);
+		close(p[i].fd[2]); close(p[i].fd[3]);
+	}
+}
+
+static void*
+wakethr(void *v)
+{
+	Side *s = v;
+
+	pthrpinger(s->p, s->me);
+	return NULL;
+}
+
+static void
+wakepthr(Run *r)
+{
+	pairpthr(r, wakethr);
+}
+
+/* delay */
+
+static void
+delaytask(Task *t, void *v)
+{
+	Run *r = v;
+	long i;
+	double t0;
+
+	for(i=0; i<r->iters; i++){
+		t0 = now();
+		taskdelay(t, 1);
+		sample(r, (now() - t0)*1e6 - 1000);
+	}
+	wgdone(&r->wg);
+}
+
+static void
+delaymain(Task *t, void *v)
+{
+	Run *r = v;
+	int i, n;
+	double t0;
+
+	n = NDELAY*r->nthr;
+	t0 = now();
+	wgadd(&r->wg, n);
+	for(i=0; i<n; i++)
+		taskcreate(t, delaytask, r);
+	wgwait(t, &r->wg);
+	r->secs = now() - t0;
+	r->ops = n*r->iters;
+}
+
+static void*
+delaythr(void *v)
+{
+	Run *r = *(Run**)v;
+	struct timespec ts = { 0, 1000*1000 };
+	long i;
+	double t0;
+
+	for(i=0; i<r->iters; i++){
+		t0 = now();
+		while(nanosleep(&ts, NULL) < 0 && errno == EINTR)
+			;
+		sample(r, (now() - t0)*1e6 - 1000);
+	}
+	return NULL;
+}
+
+static void
+delaypthr(Run *r)
+{
+	Run **arg;
+	int i, n;
+	double t0;
+
+	n = NDELAY*r->nthr;
+	arg = malloc(n * sizeof arg[0]);
+	for(i=0; i<n; i++)
+		arg[i] = r;
+	t0 = now();
+	spawn(n, delaythr, arg, sizeof arg[0]);
+	r->secs = now() - t0;
+	r->ops = n*r->iters;
+	free(arg);
+}
+
+/* pipe */
+
+static void
+pipeping(Task *t, void *v)
+{
+	Pair *p = v;
+	char c = 0;
+	long i;
+
+	for(i=0; i<p->r->iters; i++){
+		fdwrite(t, p->fd[1], &c, 1);
+		fdread(t, p->fd[2], &c, 1);
+	}
+	wgdone(&p->r->wg);
+}
+
+static void
+pipepong(Task *t, void *v)
+{
+	Pair *p = v;
+	char c;
+	long i;
+
+	for(i=0; i<p->r->iters; i++){
+		fdread(t, p->fd[0], &c, 1);
+		fdwrite(t, p->fd[3], &c, 1);
+	}
+	wgdone(&p->r->wg);
+}
+
+static void
+pipemain(Task *t, void *v)
+{
+	pairmain(t, v, pipeping, pipepong);
+}
+
+static void*
+pipethr(void *v)
+{
+	Side *s = v;
+	Pair *p = s->p;
+	char c = 0;
+	long i;
+
+	for(i=0; i<p->r->iters; i++){
+		if(s->me == 0){
+			if(write(p->fd[1], &c, 1) != 1 || read(p->fd[2], &c, 1) != 1)
+				break;
+		}else{
+			if(read(p->fd[0], &c, 1) != 1 || write(p->fd[3], &c, 1) != 1)
+				break;
+		}
+	}
+	return NULL;
+}
+
+static void
+pipepthr(Run *r)
+{
+	pairpthr(r, pipethr);
+}
+
+static Bench benches[] = {
+	{ "yield",	200000,	yieldmain,	yieldpthr },
+	{ "create",	100000,	createmain,	createpthr },
+	{ "wake",	100000,	wakemain,	wakepthr },
+	{ "delay",	50,	delaymain,	delaypthr },
+	{ "pipe",	50000,	pipemain,	pipepthr },
+};
+
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(double*)a, y = *(double*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(Run *r, char *impl)
+{
+	printf("{\"bench\":\"%s\",\"impl\":\"%s\",\"threads\":%d,"
+	    "\"ops\":%ld,\"secs\":%.6f,\"nsop\":%.1f",
+	    r->b->name, impl, r->nthr, r->ops, r->secs,
+	    r->ops ? r->secs*1e9/r->ops : 0);
+	if(r->nover > 0){
+		qsort(r->over, r->nover, sizeof r->over[0], cmpdouble);
+		printf(",\"p50us\":%.1f,\"p99us\":%.1f,\"maxus\":%.1f",
+		    r->over[r->nover/2], r->over[r->nover*99/100],
+		    r->over[r->nover-1]);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void
+runone(Bench *b, int nthr, double scale, int impl)
+{
+	Run r;
+
+	memset(&r, 0, sizeof r);
+	r.b = b;
+	r.nthr = nthr;
+	r.iters = b->iters*scale;
+	if(r.iters < 1)
+		r.iters = 1;
+	if(b->task == delaymain){
+		r.over = malloc(NDELAY*nthr*r.iters * sizeof r.over[0]);
+		if(r.over == NULL){
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+
+	if(impl & 1){
+		wginit(&r.wg);
+		libtaskmn(b->task, &r, nthr);
+		report(&r, "taskmn");
+	}
+	if(impl & 2){
+		r.nover = 0;
+		r.ops = 0;
+		b->thread(&r);
+		report(&r, "pthread");
+	}
+	free(r.over);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: schedbench [-t maxthreads] [-s scale] "
+	    "[-i taskmn|pthread] [bench...]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	Bench *b;
+	double scale;
+	int c, i, impl, maxthr, nthr, any;
+
+	maxthr = sysconf(_SC_NPROCESSORS_ONLN);
+	scale = 1;
+	impl = 3;
+	while((c = getopt(argc, argv, "i:s:t:")) != -1){
+		switch(c){
+		case 'i':
+			if(strcmp(optarg, "taskmn") == 0)
+				impl = 1;
+			else if(strcmp(optarg, "pthread") == 0)
+				impl = 2;
+			else
+				usage();
+			break;
+		case 's':
+			scale = atof(optarg);
+			if(scale <= 0)
+				usage();
+			break;
+		case 't':
+			maxthr = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if(maxthr < 1)
+		maxthr = 1;
+	argc -= optind;
+	argv += optind;
+
+	for(i=0; i<argc; i++){
+		for(b=benches; b<benches+nelem(benches); b++)
+			if(strcmp(argv[i], b->name) == 0)
+				break;
+		if(b == benches+nelem(benches)){
+			fprintf(stderr, "schedbench: unknown benchmark %s\n", argv[i]);
+			usage();
+		}
+	}
+
+	for(b=benches; b<benches+nelem(benches); b++){
+		any = argc == 0;
+		for(i=0; i<argc; i++)
+			if(strcmp(argv[i], b->name) == 0)
+				any = 1;
+		if(!any)
+			continue;
+		for(nthr=1;; nthr*=2){
+			if(nthr > maxthr)
+				nthr = maxthr;
+			runone(b, nthr, scale, impl);
+			if(nthr == maxthr)
+				break;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <taskmn.h>
+
+#include "relay.h"
+
+typedef struct Half Half;
+typedef struct Relay Relay;
+
+/* one proxied connection; the last direction to finish closes both fds */
+struct Half
+{
+	Relay	*r;
+	int	rfd;
+	int	wfd;
+};
+
+struct Relay
+{
+	Half	half[2];
+	int	bufsize;
+	int	ref;
+};
+
+static void
+rwtask(Task *t, void *v)
+{
+	Half *h = v;
+	Relay *r = h->r;
+	char *buf;
+	ssize_t n;
+
+	buf = malloc(r->bufsize);
+	if(buf == 0){
+		fprintf(stderr, "out of memory\n");
+		abort();
+	}
+	while((n = fdread(t, h->rfd, buf, r->bufsize)) > 0)
+		if(fdwrite(t, h->wfd, buf, n) != n)
+			break;
+	shutdown(h->wfd, SHUT_WR);
+	free(buf);
+	if(__atomic_sub_fetch(&r->ref, 1, __ATOMIC_ACQ_REL) == 0){
+		close(r->half[0].rfd);
+		close(r->half[1].rfd);
+		free(r);
+	}
+}
+
+void
+relaystart(Task *t, int fd, int remotefd, int bufsize)
+{
+	Relay *r;
+
+	r = malloc(sizeof *r);
+	if(r == 0){
+		fprintf(stderr, "out of memory\n");
+		abort();
+	}
+	r->half[0] = (Half){ r, fd, remotefd };
+	r->half[1] = (Half){ r, remotefd, fd };
+	r->bufsize = bufsize;
+	r->ref = 2;
+	taskcreate(t, rwtask, &r->half[0]);
+	taskcreate(t, rwtask, &r->half[1]);
+}
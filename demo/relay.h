@@ -0,0 +1,6 @@
+/*
+ * The tcpproxy relay, shared by demo/tcpproxy.c and bench/proxybench.c.
+ * relaystart() copies fd to remotefd and back in two tasks, bufsize
+ * bytes at a time, and closes both once the second direction is done.
+ */
+void	relaystart(Task *t, int fd, int remotefd, int bufsize);
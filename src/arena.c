@@ -0,0 +1,116 @@
+#include "taskimpl.h"
+
+/*
+ * Per-task arenas. taskmalloc() bumps a pointer through the task's newest
+ * chunk. Standard-size chunks come from a small cache on the current
+ * worker and go back to whichever worker the task resets or exits on, so
+ * the heap is only touched when a cache runs dry or overflows. Requests
+ * too big to share a chunk get one of their own on a second list, so
+ * they neither waste the rest of the current chunk nor get cached.
+ * A Taskmark records both list heads; resetting to it frees whatever was
+ * pushed since.
+ */
+
+struct Arenachunk
+{
+	Arenachunk	*next;
+	size_t	size;
+	size_t	used;
+	uchar	data[] __aligned(ARENAALIGN);
+};
+
+static Arenachunk*
+chunkget(size_t size)
+{
+	Worker *w = curworker;
+	Arenachunk *c;
+
+	if(size == ARENACHUNK && w && (c = w->chunks) != nil){
+		w->chunks = c->next;
+		w->nchunks--;
+	}else{
+		c = malloc(sizeof *c + size);
+		ASSERT(c, "oom");
+		c->size = size;
+	}
+	c->used = 0;
+	return c;
+}
+
+static void
+chunkput(Arenachunk *c)
+{
+	Worker *w = curworker;
+
+	if(c->size == ARENACHUNK && w && w->nchunks < ARENACACHE){
+		c->next = w->chunks;
+		w->chunks = c;
+		w->nchunks++;
+	}else
+		free(c);
+}
+
+void*
+taskmalloc(Task *t, size_t n)
+{
+	Arenachunk *c;
+
+	ASSERT(n <= SIZE_MAX/2, "taskmalloc: %zu bytes", n);
+	n = n ? (n + ARENAALIGN-1) & ~(size_t)(ARENAALIGN-1) : ARENAALIGN;
+	if(n > ARENACHUNK/4){
+		c = chunkget(n);
+		c->used = n;
+		c->next = t->arenabig;
+		t->arenabig = c;
+		return c->data;
+	}
+	c = t->arena;
+	if(c == nil || c->size - c->used < n){
+		c = chunkget(ARENACHUNK);
+		c->next = t->arena;
+		t->arena = c;
+	}
+	c->used += n;
+	return c->data + c->used - n;
+}
+
+void
+taskarenamark(Task *t, Taskmark *m)
+{
+	m->chunk = t->arena;
+	m->used = t->arena ? t->arena->used : 0;
+	m->big = t->arenabig;
+}
+
+void
+taskarenareset(Task *t, Taskmark *m)
+{
+	Arenachunk *c, *stop;
+
+	stop = m ? m->chunk : nil;
+	while((c = t->arena) != stop && c != nil){
+		t->arena = c->next;
+		chunkput(c);
+	}
+	if(c != nil)
+		c->used = m->used;
+
+	stop = m ? m->big : nil;
+	while((c = t->arenabig) != stop && c != nil){
+		t->arenabig = c->next;
+		free(c);
+	}
+}
+
+/* free a worker's chunk cache when the context goes away */
+void
+arenadrain(Worker *w)
+{
+	Arenachunk *c;
+
+	while((c = w->chunks) != nil){
+		w->chunks = c->next;
+		free(c);
+	}
+	w->nchunks = 0;
+}
@@ -0,0 +1,310 @@
+#include "taskimpl.h"
+
+/*
+ * Bounded MPMC channels. Values travel through a lock-free ring (Vyukov's
+ * bounded queue: each cell carries a sequence number telling producers and
+ * consumers whose turn it is). c->l is only taken to park or wake tasks:
+ * a receiver parks once the ring is empty, a sender once it is full.
+ *
+ * Parking uses the same handshake as QLock: the parker bumps its nwait
+ * counter and re-checks the ring under c->l; the other side updates the
+ * ring, fences, and only takes c->l if it sees a nonzero counter.
+ *
+ * A sender that finds a parked receiver copies its value straight into the
+ * receiver's buffer instead of going through the ring.
+ */
+
+struct Chancell
+{
+	uvlong	seq;
+	uchar	data[];
+};
+
+struct Channel
+{
+	uvlong	sendpos __aligned(64);
+	uvlong	recvpos __aligned(64);
+
+	/* protects the wait lists; never held across a switch */
+	pthread_mutex_t l __aligned(64);
+	Waitlist sendq;
+	Waitlist recvq;
+	int	nsendwait;
+	int	nrecvwait;
+	int	closed;
+
+	uvlong	mask;
+	int	elemsize;
+	size_t	stride;
+	uchar	*cells;
+};
+
+#define CELL(c, pos)	((struct Chancell*)((c)->cells + ((pos)&(c)->mask)*(c)->stride))
+#define CHAN_LOCK	lockmtx(&c->l)
+#define CHAN_UNLOCK	unlockmtx(&c->l)
+
+Channel*
+chancreate(int elemsize, int bufsize)
+{
+	Channel *c;
+	uvlong i, n;
+
+	ASSERT(elemsize > 0 && bufsize > 0, "chancreate: bad size");
+
+	/* the ring needs a power of two, and at least two cells */
+	for(n=2; n<(uvlong)bufsize; n<<=1)
+		;
+
+	c = malloc(sizeof *c);
+	ASSERT(c, "oom");
+	memset(c, 0, sizeof *c);
+	c->l = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	c->mask = n-1;
+	c->elemsize = elemsize;
+	c->stride = (sizeof(struct Chancell) + elemsize + 7) & ~(size_t)7;
+	c->cells = malloc(n*c->stride);
+	ASSERT(c->cells, "oom");
+	for(i=0; i<n; i++)
+		CELL(c, i)->seq = i;
+	return c;
+}
+
+void
+chanfree(Channel *c)
+{
+	ASSERT(c->sendq.head == nil && c->recvq.head == nil,
+	    "chanfree: tasks still waiting");
+	free(c->cells);
+	free(c);
+}
+
+static bool
+ringpush(Channel *c, void *v)
+{
+	struct Chancell *cell;
+	uvlong pos, seq;
+	vlong dif;
+
+	pos = __atomic_load_n(&c->sendpos, __ATOMIC_RELAXED);
+	for(;;){
+		cell = CELL(c, pos);
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (vlong)seq - (vlong)pos;
+		if(dif == 0){
+			if(__atomic_compare_exchange_n(&c->sendpos, &pos, pos+1,
+			    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}else if(dif < 0)
+			return false;	/* full */
+		else
+			pos = __atomic_load_n(&c->sendpos, __ATOMIC_RELAXED);
+	}
+	memmove(cell->data, v, c->elemsize);
+	__atomic_store_n(&cell->seq, pos+1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool
+ringpop(Channel *c, void *v)
+{
+	struct Chancell *cell;
+	uvlong pos, seq;
+	vlong dif;
+
+	pos = __atomic_load_n(&c->recvpos, __ATOMIC_RELAXED);
+	for(;;){
+		cell = CELL(c, pos);
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (vlong)seq - (vlong)(pos+1);
+		if(dif == 0){
+			if(__atomic_compare_exchange_n(&c->recvpos, &pos, pos+1,
+			    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}else if(dif < 0)
+			return false;	/* empty */
+		else
+			pos = __atomic_load_n(&c->recvpos, __ATOMIC_RELAXED);
+	}
+	memmove(v, cell->data, c->elemsize);
+	__atomic_store_n(&cell->seq, pos+c->mask+1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void
+chanparkunlock(Task *t, void *v)
+{
+	Channel *c = v;
+
+	CHAN_UNLOCK;
+}
+
+/* wake one task parked on q after the ring changed under it */
+static void
+chanwakeone(Channel *c, Waitlist *q, int *nwait)
+{
+	Waiter *w;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(nwait, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	CHAN_LOCK;
+	if((w = q->head) != nil){
+		delwaiter(q, w);
+		__atomic_sub_fetch(nwait, 1, __ATOMIC_SEQ_CST);
+	}
+	CHAN_UNLOCK;
+
+	if(w)
+		taskready(w->task);
+}
+
+/* hand v directly to a parked receiver, if there is one */
+static int
+chanhandoff(Channel *c, void *v)
+{
+	Waiter *w;
+
+	CHAN_LOCK;
+	if(c->closed){
+		CHAN_UNLOCK;
+		return -1;
+	}
+	if((w = c->recvq.head) == nil){
+		CHAN_UNLOCK;
+		return 0;
+	}
+	delwaiter(&c->recvq, w);
+	__atomic_sub_fetch(&c->nrecvwait, 1, __ATOMIC_SEQ_CST);
+	memmove(w->v, v, c->elemsize);
+	w->done = 1;
+	CHAN_UNLOCK;
+
+	taskready(w->task);
+	return 1;
+}
+
+int
+channbsend(Task *t, Channel *c, void *v)
+{
+	int rc;
+
+	if(__atomic_load_n(&c->closed, __ATOMIC_ACQUIRE))
+		return -1;
+	if(__atomic_load_n(&c->nrecvwait, __ATOMIC_RELAXED) > 0 &&
+	    (rc = chanhandoff(c, v)) != 0)
+		return rc;
+	if(!ringpush(c, v))
+		return 0;
+	chanwakeone(c, &c->recvq, &c->nrecvwait);
+	return 1;
+}
+
+int
+chansend(Task *t, Channel *c, void *v)
+{
+	Waiter w;
+	int rc;
+
+	taskpreemptpoint(t);
+	for(;;){
+		if((rc = channbsend(t, c, v)) != 0)
+			return rc > 0 ? 0 : -1;
+
+		CHAN_LOCK;
+		__atomic_add_fetch(&c->nsendwait, 1, __ATOMIC_SEQ_CST);
+		if(c->closed || ringpush(c, v)){
+			__atomic_sub_fetch(&c->nsendwait, 1, __ATOMIC_SEQ_CST);
+			rc = c->closed ? -1 : 0;
+			CHAN_UNLOCK;
+			if(rc == 0)
+				chanwakeone(c, &c->recvq, &c->nrecvwait);
+			return rc;
+		}
+		w.task = t;
+		w.v = v;
+		w.done = 0;
+		addwaiter(&c->sendq, &w);
+
+		taskstate(t, "chansend");
+		taskpark(t, WAITCHAN, chanparkunlock, c);
+		/* a slot opened up or the channel closed; try again */
+	}
+}
+
+int
+channbrecv(Task *t, Channel *c, void *v)
+{
+	int closed;
+
+	closed = __atomic_load_n(&c->closed, __ATOMIC_ACQUIRE);
+	if(ringpop(c, v)){
+		chanwakeone(c, &c->sendq, &c->nsendwait);
+		return 1;
+	}
+	return closed ? -1 : 0;
+}
+
+int
+chanrecv(Task *t, Channel *c, void *v)
+{
+	Waiter w;
+
+	taskpreemptpoint(t);
+	for(;;){
+		if(ringpop(c, v)){
+			chanwakeone(c, &c->sendq, &c->nsendwait);
+			return 1;
+		}
+
+		CHAN_LOCK;
+		__atomic_add_fetch(&c->nrecvwait, 1, __ATOMIC_SEQ_CST);
+		if(ringpop(c, v)){
+			__atomic_sub_fetch(&c->nrecvwait, 1, __ATOMIC_SEQ_CST);
+			CHAN_UNLOCK;
+			chanwakeone(c, &c->sendq, &c->nsendwait);
+			return 1;
+		}
+		if(c->closed){
+			__atomic_sub_fetch(&c->nrecvwait, 1, __ATOMIC_SEQ_CST);
+			CHAN_UNLOCK;
+			return 0;
+		}
+		w.task = t;
+		w.v = v;
+		w.done = 0;
+		addwaiter(&c->recvq, &w);
+
+		taskstate(t, "chanrecv");
+		taskpark(t, WAITCHAN, chanparkunlock, c);
+
+		if(w.done)
+			return 1;
+	}
+}
+
+void
+chanclose(Task *t, Channel *c)
+{
+	Waitlist q;
+	Waiter *w;
+
+	CHAN_LOCK;
+	__atomic_store_n(&c->closed, 1, __ATOMIC_RELEASE);
+	q.head = c->sendq.head;
+	q.tail = c->sendq.tail;
+	if(q.tail)
+		q.tail->next = c->recvq.head;
+	else
+		q.head = c->recvq.head;
+	c->sendq.head = c->sendq.tail = nil;
+	c->recvq.head = c->recvq.tail = nil;
+	c->nsendwait = c->nrecvwait = 0;
+	CHAN_UNLOCK;
+
+	/* everyone retries and finds the channel closed (or drains it) */
+	while((w = q.head) != nil){
+		q.head = w->next;
+		taskready(w->task);
+	}
+}
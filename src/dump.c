@@ -0,0 +1,244 @@
+#include "taskimpl.h"
+#include <signal.h>
+
+/*
+ * Task dumps. The task table is copied under the scheduler's shared lock
+ * and formatted once it is dropped, so a dump delays dispatch for no
+ * longer than the copy takes. Stack high-water marks take a scan of each
+ * stack, so they are read after the lock is dropped, with exiting tasks'
+ * stacks kept by stackscanbegin(). Fields of running tasks are read
+ * racily; that is fine for a diagnostic.
+ */
+
+struct Tdump
+{
+	uint	id;
+	char	what[16];
+	uvlong	ticks;	/* in the current status */
+	uvlong	runticks;
+	long	stack;	/* bytes in use, -1 if running */
+	long	maxstack;	/* high-water mark, -1 if not painted */
+	Task	*t;	/* for the high-water scan */
+	char	name[48];
+	char	state[64];
+};
+
+static char *waitname[] = {
+	[WAITNONE]	"parked",
+	[WAITFD]	"fd",
+	[WAITTIMER]	"timer",
+	[WAITRENDEZ]	"rendez",
+	[WAITLOCK]	"lock",
+	[WAITCHAN]	"channel",
+	[WAITSELECT]	"select",
+	[WAITSYNC]	"sync",
+	[WAITJOIN]	"join",
+};
+
+static long
+stackused(Task *t)
+{
+	uintptr_t sp;
+
+	sp = tasksp(t);
+	if(sp < (uintptr_t)t->stk || sp > (uintptr_t)t->stk + t->stksize)
+		return 0;	/* never ran */
+	return (uintptr_t)t->stk + t->stksize - sp;
+}
+
+static void
+dumpone(struct Tdump *d, Task *t, uvlong now)
+{
+	int w;
+
+	d->t = t;
+	d->id = t->id;
+	d->runticks = t->runticks;
+	d->stack = -1;
+	if(t->schedctx){
+		strcpy(d->what, "running");
+		d->ticks = now - t->runat;
+	}else if(t->ready || t->readyout){
+		strcpy(d->what, "ready");
+		d->ticks = now - t->readyat;
+	}else{
+		w = t->wait;
+		if(w < 0 || w >= (int)nelem(waitname))
+			w = WAITNONE;
+		snprintf(d->what, sizeof d->what, "%s", waitname[w]);
+		d->ticks = now - t->switchat;
+		d->stack = stackused(t);
+	}
+	if(d->ticks > now)	/* stamped after we read the clock */
+		d->ticks = 0;
+	memmove(d->name, t->name, sizeof d->name - 1);
+	d->name[sizeof d->name - 1] = '\0';
+	memmove(d->state, t->state, sizeof d->state - 1);
+	d->state[sizeof d->state - 1] = '\0';
+}
+
+static void
+dumpwrite(int fd, char *buf, int n)
+{
+	int m;
+
+	while(n > 0){
+		m = write(fd, buf, n);
+		if(m < 0 && errno == EINTR)
+			continue;
+		if(m <= 0)
+			return;
+		buf += m;
+		n -= m;
+	}
+}
+
+static void
+dumpto(ltctx *lt, int fd)
+{
+	struct Tdump *d;
+	char buf[256], cur[24], stk[48];
+	uvlong now;
+	Pool *p;
+	int i, n, m, np, nready, nthr;
+
+	stackscanbegin(lt);
+	slocksx(&lt->sxlock);
+	n = lt->nalltask;
+	d = malloc((n ? n : 1) * sizeof d[0]);
+	if(d == nil){
+		unlocksx(&lt->sxlock);
+		stackscanend(lt);
+		return;
+	}
+	now = cputicks();
+	for(i=0; i<n; i++)
+		dumpone(&d[i], lt->alltask[i], now);
+	unlocksx(&lt->sxlock);
+	for(i=0; i<n; i++)
+		d[i].maxstack = stackhighwater(d[i].t);
+	stackscanend(lt);
+
+	np = __atomic_load_n(&lt->npool, __ATOMIC_ACQUIRE);
+	nready = nthr = 0;
+	for(i=0; i<np; i++){
+		p = &lt->pools[i];
+		nready += __atomic_load_n(&p->nrunnable, __ATOMIC_RELAXED);
+		nthr += p->curthr;
+	}
+	m = snprintf(buf, sizeof buf, "%d tasks, %d ready to run, %d workers\n",
+	    n, nready, nthr);
+	dumpwrite(fd, buf, m);
+	for(i=0; np>1 && i<np; i++){
+		p = &lt->pools[i];
+		m = snprintf(buf, sizeof buf,
+		    "pool %d %s: %d ready to run, %d workers\n", i, p->name,
+		    __atomic_load_n(&p->nrunnable, __ATOMIC_RELAXED), p->curthr);
+		dumpwrite(fd, buf, m);
+	}
+	m = snprintf(buf, sizeof buf, "%6s %-8s %10s %10s %13s  %s\n",
+	    "id", "status", "for(ms)", "run(ms)", "stack", "name [state]");
+	dumpwrite(fd, buf, m);
+
+	for(i=0; i<n; i++){
+		if(d[i].stack >= 0)
+			snprintf(cur, sizeof cur, "%ld", d[i].stack);
+		else
+			strcpy(cur, "-");
+		if(d[i].maxstack >= 0)
+			snprintf(stk, sizeof stk, "%s/%ld", cur, d[i].maxstack);
+		else
+			strcpy(stk, cur);
+		m = snprintf(buf, sizeof buf, "%6u %-8s %10.3f %10.3f %13s  %s [%s]\n",
+		    d[i].id, d[i].what, ticksns(lt, d[i].ticks)/1e6,
+		    ticksns(lt, d[i].runticks)/1e6, stk, d[i].name, d[i].state);
+		if(m >= (int)sizeof buf)
+			m = sizeof buf - 1;
+		dumpwrite(fd, buf, m);
+	}
+	free(d);
+}
+
+void
+taskdump(Task *t, int fd)
+{
+	dumpto(t->ltcontext, fd);
+}
+
+/*
+ * Signal-triggered dumps. The handler only writes a byte to a pipe; a
+ * dedicated thread (not a task, so stuck workers can't starve it) reads
+ * it and does the dump. Signal dispositions are per process, so only the
+ * most recent taskdumpsignal() gets the signal.
+ */
+static int dumpwake = -1;
+
+static void
+dumpsig(int sig)
+{
+	int e = errno;
+
+	if(dumpwake >= 0 && write(dumpwake, "d", 1) < 0)
+		;	/* pipe full: a dump is already pending */
+	errno = e;
+}
+
+static void*
+dumper(void *arg)
+{
+	ltctx *lt = arg;
+	char c;
+	int n;
+
+	for(;;){
+		n = read(lt->dumppipe[0], &c, 1);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0 || c == 'q')
+			return nil;
+		dumpto(lt, lt->dumpfd);
+	}
+}
+
+void
+taskdumpsignal(Task *t, int sig, int fd)
+{
+	ltctx *lt = t->ltcontext;
+	struct sigaction sa;
+	int r;
+
+	lockmtx(&lt->ctllock);
+	lt->dumpfd = fd;
+	if(!lt->dumpon){
+		r = pipe(lt->dumppipe);
+		ASSERT(r == 0, "pipe: %s", strerror(errno));
+		fdnoblock(lt->dumppipe[1]);
+		r = pthread_create(&lt->dumper, nil, dumper, lt);
+		ASSERT(r == 0, "pthread_create: %s", strerror(r));
+		lt->dumpon = 1;
+	}
+	dumpwake = lt->dumppipe[1];
+	unlockmtx(&lt->ctllock);
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = dumpsig;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	r = sigaction(sig, &sa, nil);
+	ASSERT(r == 0, "sigaction: %s", strerror(errno));
+}
+
+void
+taskdumpstop(ltctx *lt)
+{
+	if(!lt->dumpon)
+		return;
+	if(dumpwake == lt->dumppipe[1])
+		dumpwake = -1;
+	while(write(lt->dumppipe[1], "q", 1) < 0 && errno == EINTR)
+		;
+	pthread_join(lt->dumper, nil);
+	close(lt->dumppipe[0]);
+	close(lt->dumppipe[1]);
+	lt->dumpon = 0;
+}
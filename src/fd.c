@@ -6,28 +6,233 @@
 
 #include "taskimpl.h"
 
-static uvlong	nsec(void);
-static void	_startfdtask(Task *);
-
-#define TRY_POLL_LOCK	trymtx(&lt->polllock)
 #define POLL_LOCK	lockmtx(&lt->polllock)
 #define POLL_UNLOCK	unlockmtx(&lt->polllock)
 #define SCHED_XLOCK	xlocksx(&lt->sxlock)
 #define SCHED_UNLOCK	unlocksx(&lt->sxlock)
 
+enum
+{
+	POLLEVERY = 1000*1000	/* ns; longest fdtask defers to others */
+};
+
+/*
+ * Registrations reach fdtask through lt->pollq, a lock-free LIFO that any
+ * worker may push to and that only fdtask pops (all at once, so there is no
+ * ABA). A pusher kicks pollwake only when fdtask is blocked in poll and
+ * nobody else has kicked it yet, so a burst of registrations costs at most
+ * one write and one read.
+ */
 static void
-fdtask(Task *task, void *v)
+pollkick(ltctx *lt)
+{
+	ssize_t rc;
+#ifdef __linux__
+	uint64_t one = 1;
+
+	rc = write(lt->pollwake[1], &one, sizeof one);
+	ASSERT(rc==sizeof one, "write(2): %s", strerror(errno));
+#else
+	rc = write(lt->pollwake[1], "w", 1);
+	ASSERT(rc==1 || errno==EAGAIN, "write(2): %s", strerror(errno));
+#endif
+}
+
+static void
+pollunkick(ltctx *lt)
+{
+#ifdef __linux__
+	uint64_t n;
+
+	(void)read(lt->pollwake[0], &n, sizeof n);
+#else
+	char buf[64];
+
+	while(read(lt->pollwake[0], buf, sizeof buf) > 0)
+		;
+#endif
+	__atomic_store_n(&lt->pollkicked, 0, __ATOMIC_SEQ_CST);
+}
+
+/* get fdtask out of poll if it is (about to be) blocked there */
+void
+pollwakeup(ltctx *lt)
+{
+	if(__atomic_load_n(&lt->pollblocked, __ATOMIC_SEQ_CST) &&
+	    !__atomic_exchange_n(&lt->pollkicked, 1, __ATOMIC_SEQ_CST))
+		pollkick(lt);
+}
+
+/* queue w for fdtask; call from the scheduler stack (see taskpark) */
+void
+pollpush(ltctx *lt, Waiter *w)
+{
+	Waiter *head;
+
+	head = __atomic_load_n(&lt->pollq, __ATOMIC_RELAXED);
+	do
+		w->next = head;
+	while(!__atomic_compare_exchange_n(&lt->pollq, &head, w, true,
+	    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	/* pairs with the pollblocked store / pollq drain in fdtask */
+	pollwakeup(lt);
+}
+
+/* parkfn for fdwait() and taskdelay() */
+static void
+pollsubmit(Task *t, void *v)
+{
+	pollpush(t->ltcontext, v);
+}
+
+/* move queued registrations into pollfd[] and sleeping; polllock held */
+static void
+polldrain(ltctx *lt)
+{
+	Waiter *w, *next, *rev, *s;
+
+	w = __atomic_exchange_n(&lt->pollq, nil, __ATOMIC_SEQ_CST);
+
+	/* the queue is LIFO; restore arrival order */
+	for(rev=nil; w!=nil; w=next){
+		next = w->next;
+		w->next = rev;
+		rev = w;
+	}
+
+	for(w=rev; w!=nil; w=next){
+		next = w->next;
+
+		if(w->fd >= 0){
+			ASSERT(lt->npollfd < MAXFD, "too many poll file descriptors");
+			lt->pollw[lt->npollfd] = w;
+			lt->pollfd[lt->npollfd].fd = w->fd;
+			lt->pollfd[lt->npollfd].events = w->bits;
+			lt->pollfd[lt->npollfd].revents = 0;
+			lt->npollfd++;
+			continue;
+		}
+
+		for(s=lt->sleeping.head; s!=nil && s->alarmtime <= w->alarmtime;
+		    s=s->next)
+			;
+		if(s){
+			w->prev = s->prev;
+			w->next = s;
+		}else{
+			w->prev = lt->sleeping.tail;
+			w->next = nil;
+		}
+		if(w->prev)
+			w->prev->next = w;
+		else
+			lt->sleeping.head = w;
+		if(w->next)
+			w->next->prev = w;
+		else
+			lt->sleeping.tail = w;
+	}
+}
+
+/*
+ * Withdraw a registration that may still be pending, e.g. a loser of
+ * taskselect(). If fdtask already fired it, w->done is set. Slots in
+ * pollfd[] are only blanked here, since fdtask may be inside poll() with
+ * the array; it compacts them when it gets back.
+ */
+void
+pollcancel(ltctx *lt, Waiter *w)
+{
+	int i;
+
+	lockmtx(&lt->polllock);
+	polldrain(lt);
+	if(!w->done){
+		if(w->fd < 0)
+			delwaiter(&lt->sleeping, w);
+		else{
+			for(i=1; i<lt->npollfd; i++){
+				if(lt->pollw[i] == w){
+					lt->pollw[i] = nil;
+					lt->pollfd[i].fd = -1;
+					break;
+				}
+			}
+		}
+	}
+	unlockmtx(&lt->polllock);
+}
+
+/*
+ * Idle stack trimming; see taskstacktrim(). Only plain fdwait() and
+ * taskdelay() waiters qualify: nothing but fdtask wakes those, and only
+ * with polllock held, so holding it keeps them parked while their stacks
+ * are trimmed. A task is trimmed at most once per park. polllock held.
+ */
+static void
+trimone(ltctx *lt, Waiter *w, uvlong ticks, uvlong trimns)
 {
-	int i, ms, ntasks, rc;
 	Task *t;
-	uvlong now;
+
+	if(w == nil || w->sel != nil || w->done)
+		return;
+	t = w->task;
+	if(t->stkpainted || t->trimat == t->switchat || ticks < t->switchat)
+		return;
+	if(ticksns(lt, ticks - t->switchat) < trimns)
+		return;
+	t->trimat = t->switchat;
+	__atomic_add_fetch(&lt->stacktrimmed, stacktrim(t), __ATOMIC_RELAXED);
+}
+
+static void
+polltrim(ltctx *lt, uvlong trimns)
+{
+	Waiter *w;
+	uvlong ticks;
+	int i;
+
+	ticks = cputicks();
+	for(i=1; i<lt->npollfd; i++)
+		trimone(lt, lt->pollw[i], ticks, trimns);
+	for(w=lt->sleeping.head; w!=nil; w=w->next)
+		trimone(lt, w, ticks, trimns);
+}
+
+void
+taskstacktrim(Task *t, uint ms)
+{
+	ltctx *lt = t->ltcontext;
+
+	__atomic_store_n(&lt->trimns, (uvlong)ms*1000000, __ATOMIC_RELAXED);
+	startfdtask(t);
+	pollwakeup(lt);	/* pick up the new period */
+}
+
+static void
+fdtask(Task *task, void *v)
+{
+	int i, ms, n, ntasks, rc;
+	Waiter *w;
+	uvlong now, start, trimns;
 	ltctx *lt = task->ltcontext;
 
 	taskname(task, "fdtask");
+	/* blocking in poll takes a worker; keep it off the other pools */
+	taskmigrate(task, 0);
 	for(;;){
-		/* let everyone else run */
-		while(taskyield(task) > 0)
+		/*
+		 * let everyone else run, but not for so long that timers and
+		 * fds go unserved; tasknswitch counts every pool's switches.
+		 * At TASKPRIOHIGH each yield would put us straight back on
+		 * the worker, so queue behind the others for this pass.
+		 */
+		tasksetprio(task, TASKPRIONORMAL);
+		start = nsec();
+		while(taskyield(task) > 0 && nsec() - start < POLLEVERY)
 			;
+		tasksetprio(task, TASKPRIOHIGH);
 		/* we're not blocking anything else - poll for i/o */
 		errno = 0;
 		taskstate(task, "poll");
@@ -43,68 +248,85 @@ fdtask(Task *task, void *v)
 
 		taskblocking(task);
 		POLL_LOCK;
-		while(lt->nwaiters > 0){
-			POLL_UNLOCK;
-			/* give other threads a chance to register fds with us */
-			POLL_LOCK;
-		}
 
-		if((t=lt->sleeping.head) == nil)
+		/* announce that we may sleep before looking at the queue */
+		__atomic_store_n(&lt->pollblocked, 1, __ATOMIC_SEQ_CST);
+		polldrain(lt);
+
+		if((w=lt->sleeping.head) == nil)
 			ms = -1;
 		else{
 			/* sleep at most 5s */
 			now = nsec();
-			if(now >= t->alarmtime)
+			if(now >= w->alarmtime)
 				ms = 0;
-			else if(now+5*1000*1000*1000LL >= t->alarmtime)
-				ms = (t->alarmtime - now)/1000000;
+			else if(now+5*1000*1000*1000LL >= w->alarmtime)
+				ms = (w->alarmtime - now + 999999)/1000000;
 			else
 				ms = 5000;
 		}
-		rc = poll(lt->pollfd, lt->npollfd, ms);
+		/* wake up for the next trimming pass */
+		trimns = __atomic_load_n(&lt->trimns, __ATOMIC_RELAXED);
+		if(trimns && (ms < 0 || ms > (int)(trimns/2000000)))
+			ms = trimns/2000000 + 1;
+		/* the last other task may have exited since we looked */
+		if(__atomic_load_n(&lt->nalltask, __ATOMIC_SEQ_CST) == 1)
+			ms = 0;
+		/* don't sit on a worker others are queued for */
+		if(__atomic_load_n(&poolof(task)->nrunnable, __ATOMIC_RELAXED) > 0)
+			ms = 0;
+		n = lt->npollfd;
+		POLL_UNLOCK;
+
+		rc = poll(lt->pollfd, n, ms);
+		__atomic_store_n(&lt->pollblocked, 0, __ATOMIC_SEQ_CST);
 		tasknonblocking(task);
 
 		if(rc < 0){
-			if(errno == EINTR){
-				POLL_UNLOCK;
+			if(errno == EINTR)
 				continue;
-			}
 			ASSERT(false, "poll: %s", strerror(errno));
 		}
 
-		/* wake up the guys who deserve it */
-		for(i=0; i<lt->npollfd; i++){
-			while(i < lt->npollfd && lt->pollfd[i].revents){
-				if(lt->pollfd[i].fd == lt->pollwake[0]){
-					/* notified -- drain pipe */
-					char c;
-					ssize_t r;
-					r = read(lt->pollwake[0], &c, 1);
-					ASSERT(r==1, "read(2): %s",
-					    strerror(errno));
-					i++;
-					lt->nwaiters++;
-				}else{
-					taskready(lt->polltask[i]);
-					--lt->npollfd;
-					lt->pollfd[i] = lt->pollfd[lt->npollfd];
-					lt->polltask[i] = lt->polltask[lt->npollfd];
+		POLL_LOCK;
+
+		if(lt->pollfd[0].revents){
+			lt->pollfd[0].revents = 0;
+			pollunkick(lt);
+		}
+
+		/* wake up the guys who deserve it; drop cancelled slots */
+		for(i=1; i<lt->npollfd; i++){
+			while(i < lt->npollfd &&
+			    (lt->pollfd[i].revents || lt->pollw[i] == nil)){
+				if((w = lt->pollw[i]) != nil){
+					w->done = 1;
+					waiterwake(w);
 				}
+				--lt->npollfd;
+				lt->pollfd[i] = lt->pollfd[lt->npollfd];
+				lt->pollw[i] = lt->pollw[lt->npollfd];
 			}
 		}
 
 		now = nsec();
-		while((t=lt->sleeping.head) && now >= t->alarmtime){
-			deltask(&lt->sleeping, t);
-			taskready(t);
+		while((w=lt->sleeping.head) && now >= w->alarmtime){
+			delwaiter(&lt->sleeping, w);
+			w->done = 1;
+			waiterwake(w);
+		}
+
+		if(trimns && now - lt->trimlast >= trimns/2){
+			lt->trimlast = now;
+			polltrim(lt, trimns);
 		}
 
 		POLL_UNLOCK;
 	}
 }
 
-static void
-_startfdtask(Task *t)
+void
+startfdtask(Task *t)
 {
 	ltctx *lt = t->ltcontext;
 	int rc;
@@ -117,6 +339,11 @@ _startfdtask(Task *t)
 
 	POLL_LOCK;
 
+#ifdef __linux__
+	rc = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	ASSERT(rc>=0, "eventfd(2): %s", strerror(errno));
+	lt->pollwake[0] = lt->pollwake[1] = rc;
+#else
 	rc = pipe(lt->pollwake);
 	ASSERT(rc==0, "pipe(2): %s", strerror(errno));
 
@@ -124,13 +351,14 @@ _startfdtask(Task *t)
 	ASSERT(rc==0, "fcntl(2): %s", strerror(errno));
 	rc = fdnoblock(lt->pollwake[1]);
 	ASSERT(rc==0, "fcntl(2): %s", strerror(errno));
+#endif
 
-	ASSERT(lt->npollfd < MAXFD, "too many poll fds");
-	lt->polltask[lt->npollfd] = nil;
-	lt->pollfd[lt->npollfd].fd = lt->pollwake[0];
-	lt->pollfd[lt->npollfd].events = POLLIN;
-	lt->pollfd[lt->npollfd].revents = 0;
-	lt->npollfd++;
+	ASSERT(lt->npollfd == 0, "poll fds before fdtask");
+	lt->pollw[0] = nil;
+	lt->pollfd[0].fd = lt->pollwake[0];
+	lt->pollfd[0].events = POLLIN;
+	lt->pollfd[0].revents = 0;
+	lt->npollfd = 1;
 
 	POLL_UNLOCK;
 
@@ -138,106 +366,54 @@ _startfdtask(Task *t)
 
 	SCHED_UNLOCK;
 
-	taskcreate(t, fdtask, 0);
+	taskcreateprio(t, TASKPRIOHIGH, fdtask, 0);
 }
 
 uint
 taskdelay(Task *task, uint ms)
 {
-	uvlong when, now;
-	ssize_t rc;
-	Task *t;
-	ltctx *lt = task->ltcontext;
-
-	_startfdtask(task);
-
-	/* try grabbing the lock first */
-	if(TRY_POLL_LOCK)
-		goto locked;
-
-	/* failing that, wake the sleeping fdtask by making an fd go active */
-	rc = write(lt->pollwake[1], "w", 1);
-	ASSERT(rc==1, "write(2): %s", strerror(errno));
+	Waiter w;
+	uvlong now;
 
-	POLL_LOCK;
-	lt->nwaiters--;
-locked:
+	startfdtask(task);
 
 	now = nsec();
-	when = now+(uvlong)ms*1000000;
-	for(t=lt->sleeping.head; t!=nil && t->alarmtime < when; t=t->next)
-		;
-
-	if(t){
-		task->prev = t->prev;
-		task->next = t;
-	}else{
-		task->prev = lt->sleeping.tail;
-		task->next = nil;
-	}
-
-	t = task;
-	t->alarmtime = when;
-	if(t->prev)
-		t->prev->next = t;
-	else
-		lt->sleeping.head = t;
-	if(t->next)
-		t->next->prev = t;
-	else
-		lt->sleeping.tail = t;
-	POLL_UNLOCK;
-
-	taskswitch(task);
+	memset(&w, 0, sizeof w);
+	w.task = task;
+	w.fd = -1;
+	w.alarmtime = now+(uvlong)ms*1000000;
+	taskstate(task, "delay %u", ms);
+	taskpark(task, WAITTIMER, pollsubmit, &w);
 
 	return (nsec() - now)/1000000;
 }
 
-void
-fdwait(Task *task, int fd, char rw)
+short
+fdwaitbits(char rw)
 {
-	int bits;
-	ssize_t rc;
-	ltctx *lt = task->ltcontext;
-
-	SCHED_XLOCK;
-	if(!lt->startedfdtask)
-		_startfdtask(task);
-	SCHED_UNLOCK;
-
-	/* try grabbing the lock first */
-	if(TRY_POLL_LOCK)
-		goto locked;
-
-	/* failing that, wake the sleeping fdtask by making an fd go active */
-	rc = write(lt->pollwake[1], "w", 1);
-	ASSERT(rc==1, "write(2): %s", strerror(errno));
-
-	POLL_LOCK;
-	lt->nwaiters--;
-locked:
-	ASSERT(lt->npollfd < MAXFD, "too many poll file descriptors");
-
-	taskstate(task, "fdwait for %s", rw=='r' ? "read" : rw=='w' ? "write" : "error");
-	bits = 0;
 	switch(rw){
 	case 'r':
-		bits |= POLLIN;
-		break;
+		return POLLIN;
 	case 'w':
-		bits |= POLLOUT;
-		break;
+		return POLLOUT;
 	}
+	return 0;
+}
+
+void
+fdwait(Task *task, int fd, char rw)
+{
+	Waiter w;
 
-	lt->polltask[lt->npollfd] = task;
-	lt->pollfd[lt->npollfd].fd = fd;
-	lt->pollfd[lt->npollfd].events = bits;
-	lt->pollfd[lt->npollfd].revents = 0;
-	lt->npollfd++;
+	startfdtask(task);
 
-	POLL_UNLOCK;
+	taskstate(task, "fdwait for %s", rw=='r' ? "read" : rw=='w' ? "write" : "error");
 
-	taskswitch(task);
+	memset(&w, 0, sizeof w);
+	w.task = task;
+	w.fd = fd;
+	w.bits = fdwaitbits(rw);
+	taskpark(task, WAITFD, pollsubmit, &w);
 }
 
 /* Like fdread but always calls fdwait before reading. */
@@ -257,6 +433,7 @@ fdread(Task *task, int fd, void *buf, int n)
 {
 	ssize_t m;
 
+	taskpreemptpoint(task);
 	while((m=read(fd, buf, n)) < 0 && errno == EAGAIN)
 		fdwait(task, fd, 'r');
 	return m;
@@ -267,6 +444,7 @@ fdwrite(Task *task, int fd, void *buf, int n)
 {
 	ssize_t m, tot;
 
+	taskpreemptpoint(task);
 	for(tot=0; tot<n; tot+=m){
 		while((m=write(fd, (char*)buf+tot, n-tot)) < 0 && errno == EAGAIN)
 			fdwait(task, fd, 'w');
@@ -285,7 +463,7 @@ fdnoblock(int fd)
 }
 
 uvlong
-nsec()
+nsec(void)
 {
 	int rc;
 	struct timespec ts;
@@ -296,6 +474,6 @@ nsec()
 	rc = clock_gettime(CLOCK_REALTIME, &ts);
 #endif
 	ASSERT(rc == 0);
-	return (uvlong)ts.tv_sec*1000*1000*1000 + ts.tv_nsec*1000;
+	return (uvlong)ts.tv_sec*1000*1000*1000 + ts.tv_nsec;
 }
 
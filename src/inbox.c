@@ -0,0 +1,148 @@
+#include "taskimpl.h"
+
+/*
+ * Work posted from threads outside the pool. Posts go on lt->inbox, a
+ * lock-free LIFO like lt->pollq; whichever worker next passes the top of
+ * its scheduler loop takes the whole list and acts on it from the
+ * scheduler stack. Posted tasks start in pools[0]. A poster only pays for
+ * a wakeup when somebody is idle: workers stalled on workavail get a
+ * signal, and a worker blocked in fdtask's poll gets a pollwake kick.
+ */
+
+#define RUNQ_LOCK	lockmtx(&p->runqueuelock)
+#define RUNQ_UNLOCK	unlockmtx(&p->runqueuelock)
+
+struct Post
+{
+	Post	*next;
+	void	(*fn)(Task *, void*);	/* nil for a wakeup */
+	void	*arg;
+	Rendez	*r;
+	int	all;
+};
+
+ltctx*
+taskcontext(Task *t)
+{
+	ltctx *lt = t->ltcontext;
+
+	/* idle workers may now be waiting on us rather than deadlocked */
+	__atomic_store_n(&lt->foreign, 1, __ATOMIC_RELAXED);
+	return lt;
+}
+
+static void
+post(ltctx *lt, Post *m)
+{
+	Post *head;
+	Pool *p;
+
+	head = __atomic_load_n(&lt->inbox, __ATOMIC_RELAXED);
+	do
+		m->next = head;
+	while(!__atomic_compare_exchange_n(&lt->inbox, &head, m, true,
+	    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	/*
+	 * pairs with the nstalled store and inbox check in taskscheduler();
+	 * posted tasks start in pools[0], so wake one of its workers
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	p = &lt->pools[0];
+	if(__atomic_load_n(&p->nstalled, __ATOMIC_RELAXED) > 0){
+		RUNQ_LOCK;
+		condnotify(&p->workavail);
+		RUNQ_UNLOCK;
+	}
+	pollwakeup(lt);
+}
+
+void
+taskpost(ltctx *lt, void (*fn)(Task *, void*), void *arg)
+{
+	Post *p;
+
+	p = malloc(sizeof *p);
+	ASSERT(p, "oom");
+	memset(p, 0, sizeof *p);
+	p->fn = fn;
+	p->arg = arg;
+	post(lt, p);
+}
+
+void
+taskpostwakeup(ltctx *lt, Rendez *r, int all)
+{
+	Post *p;
+
+	p = malloc(sizeof *p);
+	ASSERT(p, "oom");
+	memset(p, 0, sizeof *p);
+	p->r = r;
+	p->all = all;
+	post(lt, p);
+}
+
+/* the wakeup for a Rendez bound to a QLock has to be done by a task */
+static void
+wakeuptask(Task *t, void *v)
+{
+	Post *p = v;
+
+	qlock(t, p->r->q);
+	if(p->all)
+		taskwakeupall(p->r);
+	else
+		taskwakeup(p->r);
+	qunlock(t, p->r->q);
+	free(p);
+}
+
+/* called by the scheduler, holding no locks */
+void
+inboxdrain(ltctx *lt)
+{
+	Post *p, *next, *rev;
+	Task faketask;
+
+	p = __atomic_exchange_n(&lt->inbox, nil, __ATOMIC_ACQUIRE);
+
+	/* the inbox is LIFO; restore arrival order */
+	for(rev=nil; p!=nil; p=next){
+		next = p->next;
+		p->next = rev;
+		rev = p;
+	}
+
+	memset(&faketask, 0, sizeof faketask);
+	faketask.ltcontext = lt;
+	for(p=rev; p!=nil; p=next){
+		next = p->next;
+		if(p->fn){
+			taskcreate(&faketask, p->fn, p->arg);
+			free(p);
+		}else if(p->r->q){
+			taskcreate(&faketask, wakeuptask, p);
+		}else{
+			lockmtx(&p->r->l);
+			if(p->all)
+				taskwakeupall(p->r);
+			else
+				taskwakeup(p->r);
+			unlockmtx(&p->r->l);
+			free(p);
+		}
+	}
+}
+
+/* posts that arrived after the last task exited */
+void
+inboxstop(ltctx *lt)
+{
+	Post *p;
+
+	while((p = lt->inbox) != nil){
+		lt->inbox = p->next;
+		free(p);
+	}
+}
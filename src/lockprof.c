@@ -0,0 +1,233 @@
+#include "taskimpl.h"
+
+/*
+ * Lock contention profiler; see the LOCKPROF wrappers in taskimpl.h.
+ * Each thread keeps a small stack of the locks it holds, so unlock can
+ * find when (and at which site) its lock was taken. Sites link themselves
+ * onto lockprofsites the first time they record anything. Counters are
+ * bumped with relaxed atomics; with the profiler on, that costs a shared
+ * cache line per site, which is fine for a diagnostic mode.
+ */
+
+enum
+{
+	NHELD = 16
+};
+
+struct Held
+{
+	void	*l;
+	Locksite *s;
+	uvlong	at;
+};
+
+int	lockprofon;
+__thread int	lockprofnheld;
+static __thread struct Held	held[NHELD];
+static Locksite	*lockprofsites;
+
+static void
+statmax(uvlong *p, uvlong v)
+{
+	uvlong old;
+
+	old = __atomic_load_n(p, __ATOMIC_RELAXED);
+	while(v > old && !__atomic_compare_exchange_n(p, &old, v, true,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void
+lockprofacquired(void *l, Locksite *s, uvlong wait, bool contended)
+{
+	int unset = 0;
+
+	if(!__atomic_load_n(&s->registered, __ATOMIC_ACQUIRE) &&
+	    __atomic_compare_exchange_n(&s->registered, &unset, 1, false,
+	    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+		s->next = __atomic_load_n(&lockprofsites, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&lockprofsites, &s->next, s,
+		    true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	__atomic_add_fetch(&s->nacq, 1, __ATOMIC_RELAXED);
+	if(contended){
+		__atomic_add_fetch(&s->ncontended, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&s->waitticks, wait, __ATOMIC_RELAXED);
+		statmax(&s->maxwait, wait);
+	}
+
+	if(lockprofnheld < NHELD){
+		held[lockprofnheld].l = l;
+		held[lockprofnheld].s = s;
+		held[lockprofnheld].at = cputicks();
+		lockprofnheld++;
+	}
+}
+
+void
+lockprofreleased(void *l)
+{
+	uvlong hold;
+	int i;
+
+	for(i=lockprofnheld-1; i>=0; i--)
+		if(held[i].l == l)
+			break;
+	if(i < 0)
+		return;
+
+	hold = cputicks() - held[i].at;
+	__atomic_add_fetch(&held[i].s->holdticks, hold, __ATOMIC_RELAXED);
+	statmax(&held[i].s->maxhold, hold);
+
+	lockprofnheld--;
+	memmove(&held[i], &held[i+1], (lockprofnheld-i)*sizeof held[0]);
+}
+
+void
+tasklockprof(Task *t, int on)
+{
+	Locksite *s;
+
+	if(on && !lockprofon){
+		/* a fresh window */
+		s = __atomic_load_n(&lockprofsites, __ATOMIC_ACQUIRE);
+		for(; s; s = s->next){
+			s->nacq = s->ncontended = 0;
+			s->waitticks = s->maxwait = 0;
+			s->holdticks = s->maxhold = 0;
+		}
+	}
+	__atomic_store_n(&lockprofon, on != 0, __ATOMIC_RELAXED);
+}
+
+#ifdef LOCKPROF
+
+/*
+ * Lock expressions as written at the call sites, by lock. A site whose
+ * expression is missing here is listed under the expression itself, so
+ * a new lock, or a new spelling of an old one, wants an entry.
+ */
+static struct
+{
+	char	*expr;
+	char	*name;
+} locknames[] = {
+	{"&lt->sxlock",		"sxlock"},
+	{"&ltcontext->sxlock",	"sxlock"},
+	{"&p->runqueuelock",	"runqueuelock"},
+	{"&lt->polllock",		"polllock"},
+	{"&p->blockedth.l",	"blockedth"},
+	{"&lt->ctllock",		"ctllock"},
+	{"&lt->livelock",		"livelock"},
+	{"&ltcontext->livelock",	"livelock"},
+	{"&lt->stackproflock",	"stackproflock"},
+	{"&r->l",		"Rendez"},
+	{"&a->r->l",		"Rendez"},
+	{"&a[i].r->l",		"Rendez"},
+	{"&p->r.l",		"Rendez"},
+	{"&p->r->l",		"Rendez"},
+	{"&q->l",		"QLock"},
+	{"&rw->l",		"RWLock"},
+	{"&s->l",		"Sem"},
+	{"&wg->l",		"WaitGroup"},
+	{"&b->l",		"Barrier"},
+	{"&c->l",		"Channel"},
+};
+
+static char*
+lockname(Locksite *s)
+{
+	int i;
+
+	for(i=0; i<(int)nelem(locknames); i++)
+		if(strcmp(s->lock, locknames[i].expr) == 0)
+			return locknames[i].name;
+	return s->lock;
+}
+
+static int
+sitecmp(const void *a, const void *b)
+{
+	Locksite *x = *(Locksite**)a, *y = *(Locksite**)b;
+	int c;
+
+	if((c = strcmp(lockname(x), lockname(y))) != 0)
+		return c;
+	if(x->waitticks != y->waitticks)
+		return x->waitticks < y->waitticks ? 1 : -1;
+	return x->line - y->line;
+}
+
+static void
+profline(ltctx *lt, int fd, char *what, uvlong nacq, uvlong ncont,
+    uvlong wait, uvlong maxwait, uvlong hold, uvlong maxhold)
+{
+	dprintf(fd, "%-28s %10llu %10llu %5.1f%% %10.3f %9.1f %10.3f %9.1f\n",
+	    what, (unsigned long long)nacq, (unsigned long long)ncont,
+	    nacq ? 100.0*ncont/nacq : 0.0,
+	    ticksns(lt, wait)/1e6, ticksns(lt, maxwait)/1e3,
+	    ticksns(lt, hold)/1e6, ticksns(lt, maxhold)/1e3);
+}
+
+void
+tasklockprofdump(Task *t, int fd)
+{
+	ltctx *lt = t->ltcontext;
+	Locksite *s, **v;
+	uvlong nacq, ncont, wait, maxwait, hold, maxhold;
+	char site[64];
+	int i, j, n;
+
+	n = 0;
+	for(s = __atomic_load_n(&lockprofsites, __ATOMIC_ACQUIRE); s; s = s->next)
+		n++;
+	v = malloc((n ? n : 1) * sizeof v[0]);
+	if(v == nil)
+		return;
+	i = 0;
+	for(s = __atomic_load_n(&lockprofsites, __ATOMIC_ACQUIRE); s && i < n;
+	    s = s->next)
+		v[i++] = s;
+	n = i;
+	qsort(v, n, sizeof v[0], sitecmp);
+
+	dprintf(fd, "%-28s %10s %10s %6s %10s %9s %10s %9s\n", "lock / site",
+	    "acquired", "contended", "", "wait(ms)", "max(us)", "held(ms)",
+	    "max(us)");
+	for(i=0; i<n; i=j){
+		nacq = ncont = wait = maxwait = hold = maxhold = 0;
+		for(j=i; j<n && strcmp(lockname(v[j]), lockname(v[i])) == 0; j++){
+			nacq += v[j]->nacq;
+			ncont += v[j]->ncontended;
+			wait += v[j]->waitticks;
+			hold += v[j]->holdticks;
+			if(v[j]->maxwait > maxwait)
+				maxwait = v[j]->maxwait;
+			if(v[j]->maxhold > maxhold)
+				maxhold = v[j]->maxhold;
+		}
+		profline(lt, fd, lockname(v[i]), nacq, ncont, wait, maxwait, hold,
+		    maxhold);
+		for(; i<j; i++){
+			s = v[i];
+			snprintf(site, sizeof site, "  %s:%d %s", s->file, s->line,
+			    s->op);
+			profline(lt, fd, site, s->nacq, s->ncontended, s->waitticks,
+			    s->maxwait, s->holdticks, s->maxhold);
+		}
+	}
+	free(v);
+}
+
+#else
+
+void
+tasklockprofdump(Task *t, int fd)
+{
+	dprintf(fd, "lock profiling not compiled in; build with -DLOCKPROF\n");
+}
+
+#endif
@@ -46,7 +46,7 @@ netannounce(Task *t, int istcp, char *server, int port)
 	}
 
 	if(proto == SOCK_STREAM)
-		listen(fd, 16);
+		listen(fd, SOMAXCONN);
 
 	fdnoblock(fd);
 	taskstate(t, "netannounce succeeded");
@@ -0,0 +1,215 @@
+#include "taskimpl.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+
+#include <string.h>
+
+/*
+ * Per-destination pool of outbound connections. Idle connections are kept
+ * on a LIFO stack so the warmest socket is handed out first and the coldest
+ * ones age out at the bottom, where the reaper task expires them.
+ */
+
+struct Netidle
+{
+	int	fd;
+	uvlong	since;	/* nsec() at checkin */
+};
+
+struct Netpool
+{
+	Rendez	r;	/* r.l protects everything below; r sleeps for slots */
+	int	proto;
+	char	*server;
+	int	port;
+	int	maxidle;
+	int	maxtotal;	/* 0 means unlimited */
+	uvlong	idlens;
+	struct Netidle *idle;	/* idle[nidle-1] is the most recent */
+	int	nidle;
+	int	ntotal;	/* idle plus checked out plus dialing */
+	int	closing;
+	int	reaper;	/* reaper task still running; it frees the pool */
+};
+
+#define NP_LOCK		lockmtx(&p->r.l)
+#define NP_UNLOCK	unlockmtx(&p->r.l)
+
+/*
+ * An idle connection should have nothing to say. Readable means EOF or
+ * unsolicited data; either way the stream is no longer usable.
+ */
+static bool
+netalive(int fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if(poll(&pfd, 1, 0) != 0)
+		return false;
+	return true;
+}
+
+static void
+netreaper(Task *t, void *v)
+{
+	Netpool *p = v;
+	uvlong now;
+	uint ms;
+	int i, n, fds[64];
+
+	taskname(t, "netpool %s:%d", p->server, p->port);
+	ms = p->idlens/1000000/2;
+	if(ms == 0)
+		ms = 1;
+
+	for(;;){
+		taskdelay(t, ms);
+
+		NP_LOCK;
+		if(p->closing){
+			NP_UNLOCK;
+			free(p->idle);
+			free(p->server);
+			free(p);
+			return;
+		}
+
+		/* oldest entries live at the bottom of the stack */
+		now = nsec();
+		for(n=0; n<p->nidle && n<(int)nelem(fds); n++){
+			if(now - p->idle[n].since < p->idlens)
+				break;
+			fds[n] = p->idle[n].fd;
+		}
+		if(n > 0){
+			memmove(&p->idle[0], &p->idle[n],
+			    (p->nidle-n)*sizeof(p->idle[0]));
+			p->nidle -= n;
+			p->ntotal -= n;
+			taskwakeupall(&p->r);
+		}
+		NP_UNLOCK;
+
+		for(i=0; i<n; i++)
+			close(fds[i]);
+		taskstate(t, "expired %d", n);
+	}
+}
+
+Netpool*
+netpoolcreate(Task *t, int istcp, char *server, int port, int maxidle,
+    int maxtotal, uint idlems)
+{
+	Netpool *p;
+
+	p = malloc(sizeof *p);
+	ASSERT(p, "oom");
+	memset(p, 0, sizeof *p);
+	rendezinit(&p->r);
+
+	p->proto = istcp;
+	p->server = strdup(server);
+	ASSERT(p->server, "oom");
+	p->port = port;
+	p->maxidle = maxidle;
+	p->maxtotal = maxtotal;
+	p->idlens = (uvlong)idlems*1000000;
+	if(maxidle > 0){
+		p->idle = malloc(maxidle*sizeof(p->idle[0]));
+		ASSERT(p->idle, "oom");
+	}
+
+	if(idlems > 0 && maxidle > 0){
+		p->reaper = 1;
+		taskcreate(t, netreaper, p);
+	}
+	return p;
+}
+
+int
+netpoolget(Task *t, Netpool *p)
+{
+	int fd;
+
+	NP_LOCK;
+	for(;;){
+		ASSERT(!p->closing, "netpoolget on freed pool");
+
+		if(p->nidle > 0){
+			fd = p->idle[--p->nidle].fd;
+			NP_UNLOCK;
+			if(netalive(fd)){
+				taskstate(t, "netpool reuse");
+				return fd;
+			}
+			close(fd);
+			NP_LOCK;
+			p->ntotal--;
+			continue;
+		}
+
+		if(p->maxtotal == 0 || p->ntotal < p->maxtotal)
+			break;
+
+		taskstate(t, "netpool wait");
+		tasksleep(t, &p->r);
+	}
+	p->ntotal++;
+	NP_UNLOCK;
+
+	fd = netdial(t, p->proto, p->server, p->port);
+	if(fd < 0){
+		NP_LOCK;
+		p->ntotal--;
+		taskwakeup(&p->r);
+		NP_UNLOCK;
+	}
+	return fd;
+}
+
+void
+netpoolput(Task *t, Netpool *p, int fd, int reuse)
+{
+	NP_LOCK;
+	if(reuse && !p->closing && p->nidle < p->maxidle){
+		p->idle[p->nidle].fd = fd;
+		p->idle[p->nidle].since = nsec();
+		p->nidle++;
+		taskwakeup(&p->r);
+		NP_UNLOCK;
+		return;
+	}
+	p->ntotal--;
+	taskwakeup(&p->r);
+	NP_UNLOCK;
+
+	close(fd);
+}
+
+void
+netpoolfree(Task *t, Netpool *p)
+{
+	int i;
+
+	NP_LOCK;
+	ASSERT(p->ntotal == p->nidle, "netpoolfree with %d connections out",
+	    p->ntotal - p->nidle);
+	p->closing = 1;
+	for(i=0; i<p->nidle; i++)
+		close(p->idle[i].fd);
+	p->ntotal = p->nidle = 0;
+	if(p->reaper){
+		/* the reaper notices on its next tick and frees the pool */
+		NP_UNLOCK;
+		return;
+	}
+	NP_UNLOCK;
+
+	free(p->idle);
+	free(p->server);
+	free(p);
+}
@@ -0,0 +1,161 @@
+#include "taskimpl.h"
+
+/*
+ * Fork-join loops. The caller starts on the whole range and eats it grain
+ * by grain; whenever some worker is idle (stalled waiting for the run
+ * queue) and more than two grains remain, it splits off the upper half as
+ * a new task. Since the run queue is shared, the idle worker picks that
+ * half up directly, and the new task splits the same way. Splits are
+ * driven by idle workers, so a busy pool never gets more tasks than it
+ * can run.
+ *
+ * For reductions each piece accumulates into its own copy of the identity
+ * and pushes itself on pf->done when finished; the caller folds them all
+ * into *acc after the WaitGroup drains.
+ */
+
+typedef struct Pfor Pfor;
+typedef struct Prange Prange;
+
+struct Pfor
+{
+	void	(*fn)(Task *, long, long, void*, void*);
+	void	(*combine)(void*, void*, void*);
+	void	*arg;
+	long	grain;
+	size_t	accsize;
+	void	*identity;	/* copy of *acc on entry */
+	int	nqueued;	/* split off but not yet started */
+	Prange	*done;	/* finished pieces with partial results */
+	WaitGroup wg;
+};
+
+struct Prange
+{
+	Pfor	*pf;
+	long	lo;
+	long	hi;
+	Prange	*next;
+	uchar	acc[];
+};
+
+static void	pforrun(Task *, Pfor*, long, long, void*);
+
+static bool
+pforidle(Task *t, Pfor *pf)
+{
+	Pool *p = poolof(t);
+
+	return __atomic_load_n(&pf->nqueued, __ATOMIC_RELAXED) <
+	    __atomic_load_n(&p->nstalled, __ATOMIC_RELAXED);
+}
+
+static void
+pfortask(Task *t, void *v)
+{
+	Prange *r = v;
+	Pfor *pf = r->pf;
+	Prange *head;
+
+	__atomic_sub_fetch(&pf->nqueued, 1, __ATOMIC_RELAXED);
+	taskname(t, "parallel %ld-%ld", r->lo, r->hi);
+	pforrun(t, pf, r->lo, r->hi, r->acc);
+
+	if(pf->accsize == 0)
+		free(r);
+	else{
+		head = __atomic_load_n(&pf->done, __ATOMIC_RELAXED);
+		do
+			r->next = head;
+		while(!__atomic_compare_exchange_n(&pf->done, &head, r, true,
+		    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	wgdone(&pf->wg);
+}
+
+static void
+pforrun(Task *t, Pfor *pf, long lo, long hi, void *acc)
+{
+	Prange *r;
+	long mid, n;
+
+	while(lo < hi){
+		if(hi-lo > 2*pf->grain && pforidle(t, pf)){
+			mid = lo + (hi-lo)/2;
+			r = malloc(sizeof *r + pf->accsize);
+			ASSERT(r, "oom");
+			r->pf = pf;
+			r->lo = mid;
+			r->hi = hi;
+			memmove(r->acc, pf->identity, pf->accsize);
+			__atomic_add_fetch(&pf->nqueued, 1, __ATOMIC_RELAXED);
+			wgadd(&pf->wg, 1);
+			taskcreate(t, pfortask, r);
+			hi = mid;
+			continue;
+		}
+		n = hi-lo < pf->grain ? hi-lo : pf->grain;
+		pf->fn(t, lo, lo+n, acc, pf->arg);
+		lo += n;
+		taskpreemptpoint(t);
+	}
+}
+
+void
+taskparallelreduce(Task *t, long lo, long hi, long grain,
+    void (*fn)(Task *, long, long, void*, void*),
+    void (*combine)(void*, void*, void*), void *acc, size_t accsize,
+    void *arg)
+{
+	Pfor pf;
+	Prange *r;
+
+	memset(&pf, 0, sizeof pf);
+	pf.fn = fn;
+	pf.combine = combine;
+	pf.arg = arg;
+	pf.grain = grain > 0 ? grain : 1;
+	pf.accsize = accsize;
+	wginit(&pf.wg);
+	if(accsize){
+		ASSERT(combine, "taskparallelreduce: no combine");
+		pf.identity = malloc(accsize);
+		ASSERT(pf.identity, "oom");
+		memmove(pf.identity, acc, accsize);
+	}
+
+	pforrun(t, &pf, lo, hi, acc);
+	wgwait(t, &pf.wg);
+
+	while((r = pf.done) != nil){
+		pf.done = r->next;
+		combine(acc, r->acc, arg);
+		free(r);
+	}
+	free(pf.identity);
+}
+
+struct pforadapt
+{
+	void	(*fn)(Task *, long, long, void*);
+	void	*arg;
+};
+
+static void
+pforadapt(Task *t, long lo, long hi, void *acc, void *v)
+{
+	struct pforadapt *a = v;
+
+	a->fn(t, lo, hi, a->arg);
+}
+
+void
+taskparallelfor(Task *t, long lo, long hi, long grain,
+    void (*fn)(Task *, long, long, void*), void *arg)
+{
+	struct pforadapt a;
+
+	a.fn = fn;
+	a.arg = arg;
+	taskparallelreduce(t, lo, hi, grain, pforadapt, nil, nil, 0, &a);
+}
@@ -0,0 +1,263 @@
+#include "taskimpl.h"
+
+/*
+ * Task-level mutex. The owner word is taken with a single CAS when
+ * uncontended. Contenders spin briefly, then queue on q->waiting and switch
+ * away; qunlock() hands the lock straight to the first waiter, so the woken
+ * task never has to race for it.
+ *
+ * q->l only guards the wait queue and is never held across a task switch
+ * (the parking task drops it from the scheduler stack). Under q->l,
+ * nwaiting is exactly the length of q->waiting.
+ */
+
+enum
+{
+	QLOCK_SPIN = 100
+};
+
+static void
+qparkunlock(Task *t, void *v)
+{
+	QLock *q = v;
+
+	unlockmtx(&q->l);
+}
+
+void
+qlockinit(QLock *q)
+{
+	memset(q, 0, sizeof *q);
+	q->l = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+}
+
+int
+canqlock(Task *t, QLock *q)
+{
+	Task *nobody = nil;
+
+	return __atomic_compare_exchange_n(&q->owner, &nobody, t, false,
+	    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+void
+qlock(Task *t, QLock *q)
+{
+	int i;
+
+	if(canqlock(t, q))
+		return;
+
+	ASSERT(q->owner != t, "qlock: recursive lock by task %u", t->id);
+
+	/* the holder is likely running on another worker; give it a moment */
+	for(i=0; i<QLOCK_SPIN; i++){
+		cpurelax();
+		if(__atomic_load_n(&q->owner, __ATOMIC_RELAXED) == nil &&
+		    canqlock(t, q))
+			return;
+	}
+
+	lockmtx(&q->l);
+	/* pairs with the owner store and nwaiting load in qunlock() */
+	__atomic_add_fetch(&q->nwaiting, 1, __ATOMIC_SEQ_CST);
+	if(canqlock(t, q)){
+		__atomic_sub_fetch(&q->nwaiting, 1, __ATOMIC_SEQ_CST);
+		unlockmtx(&q->l);
+		return;
+	}
+	addtask(&q->waiting, t);
+
+	taskstate(t, "qlock");
+	taskpark(t, WAITLOCK, qparkunlock, q);
+
+	ASSERT(q->owner == t, "qlock: woken without ownership");
+}
+
+void
+qunlock(Task *t, QLock *q)
+{
+	Task *w;
+
+	ASSERT(q->owner == t, "qunlock: task %u does not hold lock", t->id);
+
+	if(__atomic_load_n(&q->nwaiting, __ATOMIC_SEQ_CST) == 0){
+		__atomic_store_n(&q->owner, nil, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&q->nwaiting, __ATOMIC_SEQ_CST) == 0)
+			return;
+
+		/*
+		 * Someone queued up as we let go. Either they got the lock
+		 * themselves, or whoever barged in ahead of them will hand it
+		 * over on their qunlock; otherwise it is ours to give.
+		 */
+		lockmtx(&q->l);
+		w = q->waiting.head;
+		if(w == nil || !canqlock(w, q)){
+			unlockmtx(&q->l);
+			return;
+		}
+	}else{
+		lockmtx(&q->l);
+		w = q->waiting.head;
+		if(w == nil){
+			__atomic_store_n(&q->owner, nil, __ATOMIC_SEQ_CST);
+			unlockmtx(&q->l);
+			return;
+		}
+		__atomic_store_n(&q->owner, w, __ATOMIC_SEQ_CST);
+	}
+	deltask(&q->waiting, w);
+	__atomic_sub_fetch(&q->nwaiting, 1, __ATOMIC_SEQ_CST);
+	unlockmtx(&q->l);
+
+	taskready(w);
+}
+
+/*
+ * Queue t for q without waking it; used for wait morphing (see
+ * rendezinitq). The caller holds q, so t runs only once qunlock() hands
+ * the lock over.
+ */
+void
+qlockmorph(QLock *q, Task *t)
+{
+	lockmtx(&q->l);
+	__atomic_add_fetch(&q->nwaiting, 1, __ATOMIC_SEQ_CST);
+	addtask(&q->waiting, t);
+	unlockmtx(&q->l);
+}
+
+/*
+ * RWLock. A reader bumps the counter of the slot its worker maps to and
+ * then checks rw->writer; a writer sets rw->writer and then sums the
+ * slots. With both sides using seq_cst, at least one of them sees the
+ * other. A reader may unlock on a different worker than it locked on, so
+ * single slots can go negative; only the sum means anything.
+ */
+static int
+rwslot(void)
+{
+	int w;
+
+	w = taskworker();
+	return (w < 0 ? 0 : w) % RWLOCKSLOTS;
+}
+
+static int
+rwreaders(RWLock *rw)
+{
+	int i, n;
+
+	n = 0;
+	for(i=0; i<RWLOCKSLOTS; i++)
+		n += __atomic_load_n(&rw->readers[i].n, __ATOMIC_SEQ_CST);
+	return n;
+}
+
+static void
+rwparkunlock(Task *t, void *v)
+{
+	RWLock *rw = v;
+
+	unlockmtx(&rw->l);
+}
+
+/* a reader left while a writer is pending; let the writer in if last */
+static void
+rwkickwriter(RWLock *rw)
+{
+	Task *w;
+
+	lockmtx(&rw->l);
+	w = rw->wwait;
+	if(w && rwreaders(rw) == 0)
+		rw->wwait = nil;
+	else
+		w = nil;
+	unlockmtx(&rw->l);
+
+	if(w)
+		taskready(w);
+}
+
+void
+rwlockinit(RWLock *rw)
+{
+	memset(rw, 0, sizeof *rw);
+	qlockinit(&rw->wl);
+	rw->l = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+}
+
+int
+canrlock(Task *t, RWLock *rw)
+{
+	int *n;
+
+	n = &rw->readers[rwslot()].n;
+	__atomic_add_fetch(n, 1, __ATOMIC_SEQ_CST);
+	if(!__atomic_load_n(&rw->writer, __ATOMIC_SEQ_CST))
+		return 1;
+
+	__atomic_sub_fetch(n, 1, __ATOMIC_SEQ_CST);
+	rwkickwriter(rw);
+	return 0;
+}
+
+void
+rlock(Task *t, RWLock *rw)
+{
+	while(!canrlock(t, rw)){
+		lockmtx(&rw->l);
+		if(!__atomic_load_n(&rw->writer, __ATOMIC_SEQ_CST)){
+			unlockmtx(&rw->l);
+			continue;
+		}
+		addtask(&rw->rwait, t);
+		taskstate(t, "rlock");
+		taskpark(t, WAITLOCK, rwparkunlock, rw);
+	}
+}
+
+void
+runlock(Task *t, RWLock *rw)
+{
+	__atomic_sub_fetch(&rw->readers[rwslot()].n, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&rw->writer, __ATOMIC_SEQ_CST))
+		rwkickwriter(rw);
+}
+
+void
+wlock(Task *t, RWLock *rw)
+{
+	qlock(t, &rw->wl);
+	__atomic_store_n(&rw->writer, 1, __ATOMIC_SEQ_CST);
+
+	lockmtx(&rw->l);
+	if(rwreaders(rw) == 0){
+		unlockmtx(&rw->l);
+		return;
+	}
+	rw->wwait = t;
+	taskstate(t, "wlock");
+	taskpark(t, WAITLOCK, rwparkunlock, rw);
+}
+
+void
+wunlock(Task *t, RWLock *rw)
+{
+	Tasklist l;
+	Task *r;
+
+	lockmtx(&rw->l);
+	__atomic_store_n(&rw->writer, 0, __ATOMIC_SEQ_CST);
+	l = rw->rwait;
+	rw->rwait.head = rw->rwait.tail = nil;
+	unlockmtx(&rw->l);
+
+	while((r = l.head) != nil){
+		l.head = r->next;
+		taskready(r);
+	}
+	qunlock(t, &rw->wl);
+}
@@ -3,37 +3,116 @@
 void rendezinit(Rendez *r)
 {
 	r->l = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	r->waiting.head = r->waiting.tail = nil;
+	r->q = nil;
+}
+
+/*
+ * A Rendez bound to a QLock is protected by that lock instead of r->l,
+ * which then only guards the wait list. Wakeups do not make the sleepers
+ * runnable; they move them onto q's wait list ("wait morphing"), so a
+ * taskwakeupall() turns into a chain of qunlock() handoffs rather than a
+ * herd of tasks all fighting for q at once.
+ */
+void
+rendezinitq(Rendez *r, QLock *q)
+{
+	rendezinit(r);
+	r->q = q;
 }
 
 /*
  * sleep and wakeup
  */
+static void
+sleepunlock(Task *t, void *v)
+{
+	Rendez *r = v;
+
+	unlockmtx(&r->l);
+}
+
+static void
+sleepqunlock(Task *t, void *v)
+{
+	Rendez *r = v;
+
+	unlockmtx(&r->l);
+	qunlock(t, r->q);
+}
+
 void
 tasksleep(Task *t, Rendez *r)
 {
-	addtask(&r->waiting, t);
-	unlockmtx(&r->l);
+	Waiter w;
+
+	memset(&w, 0, sizeof w);
+	w.task = t;
 
 	taskstate(t, "sleep");
-	taskswitch(t);
+	if(r->q){
+		ASSERT(r->q->owner == t, "tasksleep: task %u does not hold q",
+		    t->id);
+		lockmtx(&r->l);
+		addwaiter(&r->waiting, &w);
+		taskpark(t, WAITRENDEZ, sleepqunlock, r);
+		/* the waker queued us on q; qunlock() handed it over */
+		ASSERT(r->q->owner == t, "tasksleep: woken without q");
+		return;
+	}
+
+	addwaiter(&r->waiting, &w);
+	/* wakers need r->l, so hold it until our context is saved */
+	taskpark(t, WAITRENDEZ, sleepunlock, r);
 
 	lockmtx(&r->l);
 }
 
+/*
+ * Like tasksleep(), but give up after ms milliseconds. Returns 1 if woken,
+ * 0 on timeout; either way the lock is held again on return.
+ */
+int
+tasksleeptimed(Task *t, Rendez *r, uint ms)
+{
+	Alt a[2];
+
+	memset(a, 0, sizeof a);
+	a[0].op = ALTSLEEP;
+	a[0].r = r;
+	a[1].op = ALTTIMER;
+	a[1].ms = ms;
+	return taskselect(t, a, 2) == 0;
+}
+
 static int
 _taskwakeup(Rendez *r, int all)
 {
 	int i;
-	Task *t;
+	Waiter *w;
 
-	for(i=0;; i++){
+	if(r->q){
+		ASSERT(r->q->owner == curtask,
+		    "taskwakeup: q not held by caller");
+		lockmtx(&r->l);
+	}
+	for(i=0;;){
 		if(i==1 && !all)
 			break;
-		if((t = r->waiting.head) == nil)
+		if((w = r->waiting.head) == nil)
 			break;
-		deltask(&r->waiting, t);
-		taskready(t);
+		delwaiter(&r->waiting, w);
+		w->done = 1;
+		if(r->q && w->sel == nil){
+			qlockmorph(r->q, w->task);
+			i++;
+		}else if(waiterwake(w)){
+			/* a select waiter may already have been woken */
+			i++;
+		}
 	}
+	if(r->q)
+		unlockmtx(&r->l);
 	return i;
 }
 
@@ -48,4 +127,3 @@ taskwakeupall(Rendez *r)
 {
 	return _taskwakeup(r, 1);
 }
-
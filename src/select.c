@@ -0,0 +1,177 @@
+#include "taskimpl.h"
+
+/*
+ * Multi-way wait. taskselect() registers one Waiter per alternative, all
+ * sharing a Sel. Whichever waker first moves sel->won off -1 owns the
+ * wakeup; the rest find the CAS failed and leave the task alone.
+ *
+ * Registration happens from the scheduler stack (selpark), and the first
+ * alternative can fire before the last one is registered. So readying the
+ * task takes two steps: the winner and selpark each drop sel->pending, and
+ * whoever drops it to zero calls taskready().
+ */
+
+static void
+selready(Sel *s)
+{
+	if(__atomic_sub_fetch(&s->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		taskready(s->task);
+}
+
+/*
+ * Wake the task behind w. The caller has already dequeued w under the lock
+ * of whatever queue it sat on. Returns false if w lost a select race.
+ */
+bool
+waiterwake(Waiter *w)
+{
+	Sel *s;
+	int nobody = -1;
+
+	if((s = w->sel) == nil){
+		taskready(w->task);
+		return true;
+	}
+	if(!__atomic_compare_exchange_n(&s->won, &nobody, w->idx, false,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return false;
+	selready(s);
+	return true;
+}
+
+/*
+ * The rendez lock of an ALTSLEEP alternative: r->q, or r->l. Several
+ * Rendez bound to one QLock share it, and it must be dropped and retaken
+ * only once.
+ */
+static void*
+altlock(Alt *a)
+{
+	return a->r->q ? (void*)a->r->q : (void*)&a->r->l;
+}
+
+/* does an ALTSLEEP in a[lo..hi) share a[i]'s lock? */
+static bool
+altshared(Alt *a, int i, int lo, int hi)
+{
+	int j;
+
+	for(j=lo; j<hi; j++)
+		if(j != i && a[j].op == ALTSLEEP && altlock(&a[j]) == altlock(&a[i]))
+			return true;
+	return false;
+}
+
+static void
+selpark(Task *t, void *v)
+{
+	Sel *s = v;
+	Alt *a;
+	int i;
+
+	for(i=0; i<s->n; i++){
+		a = &s->alt[i];
+		switch(a->op){
+		case ALTSLEEP:
+			if(a->r->q){
+				lockmtx(&a->r->l);
+				addwaiter(&a->r->waiting, &s->w[i]);
+				unlockmtx(&a->r->l);
+			}else
+				addwaiter(&a->r->waiting, &s->w[i]);
+			/* a shared lock goes once every sharer is queued */
+			if(altshared(s->alt, i, i+1, s->n))
+				break;
+			if(a->r->q)
+				qunlock(t, a->r->q);
+			else
+				unlockmtx(&a->r->l);
+			break;
+		case ALTREAD:
+		case ALTWRITE:
+		case ALTTIMER:
+			pollpush(t->ltcontext, &s->w[i]);
+			break;
+		}
+	}
+	selready(s);
+}
+
+int
+taskselect(Task *t, Alt *a, int n)
+{
+	Waiter w[TASKSELECTMAX];
+	Sel s;
+	uvlong now;
+	int i, polled;
+
+	ASSERT(n > 0 && n <= TASKSELECTMAX, "taskselect: %d alternatives", n);
+
+	s.task = t;
+	s.won = -1;
+	s.pending = 2;	/* selpark and the winner */
+	s.alt = a;
+	s.w = w;
+	s.n = n;
+
+	polled = 0;
+	now = nsec();
+	memset(w, 0, n*sizeof w[0]);
+	for(i=0; i<n; i++){
+		w[i].task = t;
+		w[i].sel = &s;
+		w[i].idx = i;
+		w[i].fd = -1;
+		switch(a[i].op){
+		case ALTSLEEP:
+			break;
+		case ALTREAD:
+			w[i].fd = a[i].fd;
+			w[i].bits = fdwaitbits('r');
+			polled = 1;
+			break;
+		case ALTWRITE:
+			w[i].fd = a[i].fd;
+			w[i].bits = fdwaitbits('w');
+			polled = 1;
+			break;
+		case ALTTIMER:
+			w[i].alarmtime = now+(uvlong)a[i].ms*1000000;
+			polled = 1;
+			break;
+		default:
+			ASSERT(false, "taskselect: bad op %d", a[i].op);
+		}
+	}
+	if(polled)
+		startfdtask(t);
+
+	taskstate(t, "select");
+	taskpark(t, WAITSELECT, selpark, &s);
+
+	/*
+	 * Withdraw the losers. Rendez locks come back in array order, just
+	 * as the caller took them, each at its first use; fired alternatives
+	 * are marked done.
+	 */
+	for(i=0; i<n; i++){
+		if(a[i].op == ALTSLEEP){
+			/* select waiters are never morphed; retake q ourselves */
+			if(!altshared(a, i, 0, i)){
+				if(a[i].r->q)
+					qlock(t, a[i].r->q);
+				else
+					lockmtx(&a[i].r->l);
+			}
+			if(a[i].r->q)
+				lockmtx(&a[i].r->l);
+			if(!w[i].done)
+				delwaiter(&a[i].r->waiting, &w[i]);
+			if(a[i].r->q)
+				unlockmtx(&a[i].r->l);
+		}else if(i != s.won)
+			pollcancel(t->ltcontext, &w[i]);
+	}
+
+	return s.won;
+}
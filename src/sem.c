@@ -0,0 +1,219 @@
+#include "taskimpl.h"
+
+/*
+ * Semaphores, WaitGroups and barriers. Each keeps its state in one atomic
+ * word and only takes its mutex to park or wake tasks. Parkers bump a
+ * waiter count (or, for barriers, sample the generation) before their last
+ * check of that word, so a waker that sees no waiters can skip the lock.
+ */
+
+static void
+parkunlock(Task *t, void *v)
+{
+	unlockmtx(v);
+}
+
+/*
+ * Semaphores
+ */
+void
+seminit(Sem *s, int n)
+{
+	memset(s, 0, sizeof *s);
+	s->count = n;
+	s->l = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+}
+
+static bool
+semtake(Sem *s)
+{
+	int c;
+
+	c = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+	while(c > 0)
+		if(__atomic_compare_exchange_n(&s->count, &c, c-1, true,
+		    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return true;
+	return false;
+}
+
+int
+semtryacquire(Task *t, Sem *s)
+{
+	return semtake(s);
+}
+
+void
+semacquire(Task *t, Sem *s)
+{
+	if(semtake(s))
+		return;
+
+	lockmtx(&s->l);
+	__atomic_add_fetch(&s->nwaiting, 1, __ATOMIC_SEQ_CST);
+	if(semtake(s)){
+		__atomic_sub_fetch(&s->nwaiting, 1, __ATOMIC_SEQ_CST);
+		unlockmtx(&s->l);
+		return;
+	}
+	addtask(&s->waiting, t);
+	taskstate(t, "semacquire");
+	taskpark(t, WAITSYNC, parkunlock, &s->l);
+	/* semrelease() handed us its permit */
+}
+
+void
+semrelease(Task *t, Sem *s)
+{
+	Task *w;
+
+	w = nil;
+	if(__atomic_load_n(&s->nwaiting, __ATOMIC_SEQ_CST) == 0){
+		__atomic_add_fetch(&s->count, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&s->nwaiting, __ATOMIC_SEQ_CST) == 0)
+			return;
+
+		/* someone queued as we posted; pass the permit on if it's free */
+		lockmtx(&s->l);
+		if(s->waiting.head && semtake(s))
+			w = s->waiting.head;
+	}else{
+		lockmtx(&s->l);
+		if((w = s->waiting.head) == nil)
+			__atomic_add_fetch(&s->count, 1, __ATOMIC_SEQ_CST);
+	}
+	if(w){
+		deltask(&s->waiting, w);
+		__atomic_sub_fetch(&s->nwaiting, 1, __ATOMIC_SEQ_CST);
+	}
+	unlockmtx(&s->l);
+
+	if(w)
+		taskready(w);
+}
+
+/*
+ * WaitGroups. Count and waiter total share one word, so the wgdone() that
+ * reaches zero learns atomically whether anyone waits; if not, it never
+ * touches wg again, and the group may be gone (say, off a returning
+ * caller's stack) as soon as wgwait() sees the zero.
+ */
+#define WGCOUNT(v)	((int)((v)>>32))
+#define WGWAITERS(v)	((uint)(v))
+
+void
+wginit(WaitGroup *wg)
+{
+	memset(wg, 0, sizeof *wg);
+	wg->l = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+}
+
+void
+wgadd(WaitGroup *wg, int n)
+{
+	Tasklist l;
+	Task *t;
+	uvlong v;
+	uint nw;
+
+	v = __atomic_add_fetch(&wg->state, (uvlong)(vlong)n<<32, __ATOMIC_SEQ_CST);
+	ASSERT(WGCOUNT(v) >= 0, "wgadd: negative count");
+	if(WGCOUNT(v) > 0 || WGWAITERS(v) == 0)
+		return;
+
+	/*
+	 * every registered waiter is queued by the time we get wg->l; take
+	 * off only those, as the group may have been rearmed since
+	 */
+	lockmtx(&wg->l);
+	l = wg->waiting;
+	wg->waiting.head = wg->waiting.tail = nil;
+	nw = 0;
+	for(t=l.head; t!=nil; t=t->next)
+		nw++;
+	__atomic_sub_fetch(&wg->state, nw, __ATOMIC_SEQ_CST);
+	unlockmtx(&wg->l);
+
+	while((t = l.head) != nil){
+		l.head = t->next;
+		taskready(t);
+	}
+}
+
+void
+wgdone(WaitGroup *wg)
+{
+	wgadd(wg, -1);
+}
+
+void
+wgwait(Task *t, WaitGroup *wg)
+{
+	uvlong v;
+
+	/* a wakeup can race with wgadd() rearming the group; wait again */
+	for(;;){
+		v = __atomic_load_n(&wg->state, __ATOMIC_SEQ_CST);
+		if(WGCOUNT(v) == 0)
+			return;
+
+		lockmtx(&wg->l);
+		do{
+			if(WGCOUNT(v) == 0){
+				unlockmtx(&wg->l);
+				return;
+			}
+		}while(!__atomic_compare_exchange_n(&wg->state, &v, v+1, true,
+		    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+		addtask(&wg->waiting, t);
+		taskstate(t, "wgwait");
+		taskpark(t, WAITSYNC, parkunlock, &wg->l);
+	}
+}
+
+/*
+ * Barriers
+ */
+void
+barrierinit(Barrier *b, int n)
+{
+	ASSERT(n > 0, "barrierinit: n %d", n);
+	memset(b, 0, sizeof *b);
+	b->n = n;
+	b->l = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+}
+
+int
+barrierwait(Task *t, Barrier *b)
+{
+	Tasklist l;
+	Task *w;
+	uint gen;
+
+	gen = __atomic_load_n(&b->gen, __ATOMIC_SEQ_CST);
+	if(__atomic_add_fetch(&b->count, 1, __ATOMIC_SEQ_CST) == b->n){
+		/* last one in: reset for the next round, then open the gate */
+		lockmtx(&b->l);
+		__atomic_store_n(&b->count, 0, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&b->gen, 1, __ATOMIC_SEQ_CST);
+		l = b->waiting;
+		b->waiting.head = b->waiting.tail = nil;
+		unlockmtx(&b->l);
+
+		while((w = l.head) != nil){
+			l.head = w->next;
+			taskready(w);
+		}
+		return 1;
+	}
+
+	lockmtx(&b->l);
+	if(__atomic_load_n(&b->gen, __ATOMIC_SEQ_CST) != gen){
+		unlockmtx(&b->l);
+		return 0;
+	}
+	addtask(&b->waiting, t);
+	taskstate(t, "barrier");
+	taskpark(t, WAITSYNC, parkunlock, &b->l);
+	return 0;
+}
@@ -0,0 +1,189 @@
+#include "taskimpl.h"
+
+/*
+ * Stack high-water marks. A painted stack is filled with STACKCANARY
+ * when the task is allocated; stacks grow down, so the lowest word that
+ * no longer holds the pattern is as deep as the task ever went. Exiting
+ * tasks are folded into a table keyed by task name. It is searched
+ * linearly, which is fine for the handful of task kinds a program has;
+ * past MAXSTACKNAME distinct names the rest are lumped together.
+ */
+
+#define STACKPROF_LOCK		lockmtx(&lt->stackproflock)
+#define STACKPROF_UNLOCK	unlockmtx(&lt->stackproflock)
+
+#define STACKCANARY	0x5354414b5354414bULL	/* "KATSKATS" */
+
+enum
+{
+	MAXSTACKNAME = 1024
+};
+
+struct Stackname
+{
+	char	name[64];
+	uvlong	ntask;
+	uvlong	sum;
+	long	max;
+	int	live;	/* in a dump only */
+};
+
+void
+stackpaint(Task *t)
+{
+	uvlong *p, *e;
+
+	p = (uvlong*)t->stk;
+	e = (uvlong*)(t->stk + t->stksize);
+	while(p < e)
+		*p++ = STACKCANARY;
+	t->stkpainted = 1;
+}
+
+/* bytes of t's stack ever used, or -1 if it was not painted */
+long
+stackhighwater(Task *t)
+{
+	uvlong *p, *e;
+
+	if(!t->stkpainted)
+		return -1;
+	p = (uvlong*)t->stk;
+	e = (uvlong*)(t->stk + t->stksize);
+	while(p < e && *p == STACKCANARY)
+		p++;
+	return (uchar*)e - (uchar*)p;
+}
+
+static char*
+keyname(Task *t)
+{
+	return t->name[0] ? t->name : "(unnamed)";
+}
+
+static Stackname*
+lookup(Stackname *tab, int *n, char *name)
+{
+	Stackname *s;
+	int i;
+
+	for(i=0; i<*n; i++)
+		if(strncmp(tab[i].name, name, sizeof tab[i].name - 1) == 0)
+			return &tab[i];
+	if(*n == MAXSTACKNAME)
+		return &tab[MAXSTACKNAME-1];
+	s = &tab[(*n)++];
+	memset(s, 0, sizeof *s);
+	snprintf(s->name, sizeof s->name, "%s",
+	    *n == MAXSTACKNAME ? "(other names)" : name);
+	return s;
+}
+
+static void
+account(Stackname *s, long used)
+{
+	s->ntask++;
+	s->sum += used;
+	if(used > s->max)
+		s->max = used;
+}
+
+/* called by the scheduler once t has switched out for the last time */
+void
+stackprofexit(ltctx *lt, Task *t)
+{
+	long used;
+
+	used = stackhighwater(t);
+	STACKPROF_LOCK;
+	if(lt->stacknames == nil)
+		lt->stacknames = malloc(MAXSTACKNAME * sizeof lt->stacknames[0]);
+	if(lt->stacknames)
+		account(lookup(lt->stacknames, &lt->nstackname, keyname(t)), used);
+	STACKPROF_UNLOCK;
+}
+
+void
+stackprofstop(ltctx *lt)
+{
+	free(lt->stacknames);
+	lt->stacknames = nil;
+	lt->nstackname = 0;
+}
+
+void
+taskstackprof(Task *t, int on)
+{
+	ltctx *lt = t->ltcontext;
+
+	if(on && !lt->stackprof){
+		/* a fresh window */
+		STACKPROF_LOCK;
+		lt->nstackname = 0;
+		STACKPROF_UNLOCK;
+	}
+	__atomic_store_n(&lt->stackprof, on != 0, __ATOMIC_RELAXED);
+}
+
+static int
+namecmp(const void *a, const void *b)
+{
+	const Stackname *x = a, *y = b;
+
+	if(x->max != y->max)
+		return x->max < y->max ? 1 : -1;
+	return strcmp(x->name, y->name);
+}
+
+void
+taskstackprofdump(Task *t, int fd)
+{
+	ltctx *lt = t->ltcontext;
+	Stackname *tab, *s;
+	Task **live;
+	long used;
+	int i, n, nlive;
+
+	tab = malloc(MAXSTACKNAME * sizeof tab[0]);
+	if(tab == nil)
+		return;
+	STACKPROF_LOCK;
+	n = lt->nstackname;
+	memmove(tab, lt->stacknames, n * sizeof tab[0]);
+	STACKPROF_UNLOCK;
+
+	/* only the task list is copied under the lock; the stacks stay put */
+	stackscanbegin(lt);
+	slocksx(&lt->sxlock);
+	nlive = lt->nalltask;
+	live = malloc((nlive ? nlive : 1) * sizeof live[0]);
+	if(live)
+		memmove(live, lt->alltask, nlive * sizeof live[0]);
+	unlocksx(&lt->sxlock);
+	if(live == nil){
+		stackscanend(lt);
+		free(tab);
+		return;
+	}
+	for(i=0; i<nlive; i++){
+		if((used = stackhighwater(live[i])) < 0)
+			continue;
+		s = lookup(tab, &n, keyname(live[i]));
+		account(s, used);
+		s->live++;
+	}
+	stackscanend(lt);
+	free(live);
+
+	qsort(tab, n, sizeof tab[0], namecmp);
+	dprintf(fd, "stack usage in bytes, of %u per task\n", t->stksize);
+	dprintf(fd, "%-40s %9s %6s %9s %9s\n", "name", "tasks", "live",
+	    "max", "mean");
+	for(i=0; i<n; i++){
+		s = &tab[i];
+		dprintf(fd, "%-40.40s %9llu %6d %9ld %9.0f\n", s->name,
+		    (unsigned long long)s->ntask, s->live, s->max,
+		    (double)s->sum/s->ntask);
+	}
+	free(tab);
+}
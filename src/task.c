@@ -1,6 +1,16 @@
 /* Copyright (c) 2005 Russ Cox, MIT; see COPYRIGHT */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* CPU_SET, pthread_setaffinity_np */
+#endif
+
 #include "taskimpl.h"
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -8,24 +18,39 @@
 #include <string.h>
 #include <syslog.h>
 
+static __thread int	workerid = -1;	/* see taskworker() */
+__thread Worker	*curworker;	/* see taskpoolslice() */
+
 static void		contextswitch(Context *from, Context *to);
 static __inline int	imin(int a, int b) { return (a < b ? a : b); }
-static void		spawn(int left, ltctx *);
+static void		spawn(int left, ltctx *, Pool *);
+__thread Task		*curtask;
+static Worker*		workerattach(ltctx *);
+static void		workerpin(ltctx *, Worker *);
+static void		workerunpin(ltctx *, Worker *);
 #define LOG(args...) \
     	do{ \
 		if(lt->log){ \
 			syslog(LOG_DEBUG, args); \
 		} \
 	}while(0)
-#define POOL_LOCK	lockmtx(&lt->blockedth.l)
-#define POOL_UNLOCK	unlockmtx(&lt->blockedth.l)
-#define RUNQ_LOCK	lockmtx(&lt->runqueuelock)
-#define RUNQ_UNLOCK	unlockmtx(&lt->runqueuelock)
+#define CTL_LOCK	lockmtx(&lt->ctllock)
+#define CTL_UNLOCK	unlockmtx(&lt->ctllock)
+#define POOL_LOCK	lockmtx(&p->blockedth.l)
+#define POOL_UNLOCK	unlockmtx(&p->blockedth.l)
+#define RUNQ_LOCK	lockmtx(&p->runqueuelock)
+#define RUNQ_UNLOCK	unlockmtx(&p->runqueuelock)
 #define SCHED_XLOCK	xlocksx(&lt->sxlock)
 #define SCHED_SLOCK	slocksx(&lt->sxlock)
 #define SCHED_UNLOCK	unlocksx(&lt->sxlock)
-#define RUN_STALLED	condwaittime(&lt->workavail, &lt->runqueuelock, 2000/*ms*/)
-#define RUN_AVAIL	condnotify(&lt->workavail)
+#define RUN_STALLED	condwaittime(&p->workavail, &p->runqueuelock, 2000/*ms*/)
+#define RUN_AVAIL	condnotify(&p->workavail)
+#define RUN_ALLDONE	condnotifyall(&p->workavail)
+
+enum
+{
+	RUNQ_AGE = 16	/* see runqget() */
+};
 
 static void __printflike(3, 4)
 taskdebug(ltctx *lt, Task *task, char *fmt, ...)
@@ -59,21 +84,157 @@ taskstart(uint y, uint x)
 	taskexit(t, 0);
 }
 
+/*
+ * With NUMA placement on, stacks are mapped directly and given a preferred
+ * node, so a task's frames live next to the workers that run it. The bind
+ * is best effort; without kernel NUMA support it just fails.
+ */
+static void*
+stackalloc(ltctx *lt, int node, uint sz, uint *mapsize)
+{
+	void *stk;
+#if defined(__linux__) && defined(SYS_mbind)
+	unsigned long mask;
+#endif
+
+	*mapsize = 0;
+	if(lt->nnode <= 1){
+		stk = malloc(sz);
+		ASSERT(stk, "oom");
+		return stk;
+	}
+
+	stk = mmap(nil, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+	    -1, 0);
+	ASSERT(stk != MAP_FAILED, "mmap stack: %s", strerror(errno));
+#if defined(__linux__) && defined(SYS_mbind)
+	mask = 1UL<<node;
+	syscall(SYS_mbind, stk, (unsigned long)sz, 1/*MPOL_PREFERRED*/, &mask,
+	    (unsigned long)(sizeof mask*8), 0);
+#endif
+	*mapsize = sz;
+	return stk;
+}
+
+/* saved stack pointer of a task that is switched out */
+uintptr_t
+tasksp(Task *t)
+{
+#if defined(__x86_64__)
+	return t->context.uc.uc_mcontext.mc_rsp;
+#else
+	return t->context.uc.uc_mcontext.mc_esp;
+#endif
+}
+
+/*
+ * Give the pages of a parked task's stack below its stack pointer (less
+ * TRIMGUARD bytes) back to the kernel; they come back zeroed if the task
+ * ever reaches that deep again. The caller must keep t from running
+ * meanwhile; see polltrim(). Returns the number of bytes released.
+ */
+uvlong
+stacktrim(Task *t)
+{
+	uintptr_t sp, lo, hi, pg;
+
+	sp = tasksp(t);
+	if(sp < (uintptr_t)t->stk || sp > (uintptr_t)t->stk + t->stksize)
+		return 0;	/* never ran */
+	if(sp - (uintptr_t)t->stk < TRIMGUARD)
+		return 0;
+	pg = sysconf(_SC_PAGESIZE);
+	lo = ((uintptr_t)t->stk + pg-1) & ~(pg-1);
+	hi = (sp - TRIMGUARD) & ~(pg-1);
+	if(hi <= lo)
+		return 0;
+#ifdef __linux__
+	if(madvise((void*)lo, hi-lo, MADV_DONTNEED) < 0)
+#else
+	if(madvise((void*)lo, hi-lo, MADV_FREE) < 0)
+#endif
+		return 0;
+	return hi - lo;
+}
+
+/* t lives on its stack, so this is the last thing anyone does with it */
+static void
+stackfree(Task *t)
+{
+	ltctx *lt = t->ltcontext;
+	void *stk = t->stk;
+	uint mapsize = t->stkmapsize;
+
+	/*
+	 * t has left alltask, so a scan that has not yet copied it never
+	 * will, and one that has bumped nstackscan before doing so.
+	 */
+	if(__atomic_load_n(&lt->nstackscan, __ATOMIC_RELAXED)){
+		lockmtx(&lt->stackproflock);
+		if(lt->nstackscan){
+			t->next = lt->stackdefer;
+			lt->stackdefer = t;
+			t = nil;
+		}
+		unlockmtx(&lt->stackproflock);
+		if(t == nil)
+			return;
+	}
+	if(mapsize)
+		munmap(stk, mapsize);
+	else
+		free(stk);
+}
+
+/*
+ * Between these, stacks of tasks that exit are kept rather than freed,
+ * so a caller can copy lt->alltask under the shared lock, drop it, and
+ * then read the stacks at leisure.
+ */
+void
+stackscanbegin(ltctx *lt)
+{
+	lockmtx(&lt->stackproflock);
+	__atomic_store_n(&lt->nstackscan, lt->nstackscan+1, __ATOMIC_RELAXED);
+	unlockmtx(&lt->stackproflock);
+}
+
+void
+stackscanend(ltctx *lt)
+{
+	Task *t, *next;
+
+	lockmtx(&lt->stackproflock);
+	__atomic_store_n(&lt->nstackscan, lt->nstackscan-1, __ATOMIC_RELAXED);
+	t = nil;
+	if(lt->nstackscan == 0){
+		t = lt->stackdefer;
+		lt->stackdefer = nil;
+	}
+	unlockmtx(&lt->stackproflock);
+	for(; t; t=next){
+		next = t->next;
+		stackfree(t);
+	}
+}
+
 static Task*
 taskalloc(Task *task, void (*fn)(Task *, void*), void *arg)
 {
 	void *stack;
 	Task *t;
 	sigset_t zero;
-	uint x, y;
+	uint x, y, mapsize;
 	ulong z;
-	int rc;
+	int rc, node;
 	ltctx *lt = task->ltcontext;
 	const int SZ = 128*1024;
 
+	/* start on the creator's node */
+	node = curworker ? curworker->node : 0;
+
 	/* allocate the task and stack together */
-	stack = malloc(SZ/*stack*/);
-	ASSERT(stack, "oom");
+	stack = stackalloc(lt, node, SZ/*stack*/, &mapsize);
 
 	/* put task struct at the end of the stack */
 	t = (Task*)((char*)stack + SZ - sizeof(*t));
@@ -81,6 +242,8 @@ taskalloc(Task *task, void (*fn)(Task *, void*), void *arg)
 
 	memset(t, 0, sizeof *t);
 	t->stk = stack;
+	t->stkmapsize = mapsize;
+	t->node = node;
 	t->stksize = (char*)t - (char*)stack;
 	SCHED_XLOCK;
 	t->id = ++lt->taskidgen;
@@ -88,6 +251,10 @@ taskalloc(Task *task, void (*fn)(Task *, void*), void *arg)
 	t->startfn = fn;
 	t->startarg = arg;
 	t->ltcontext = lt;
+	t->prio = TASKPRIONORMAL;
+	t->pool = task->pool;
+	if(__atomic_load_n(&lt->stackprof, __ATOMIC_RELAXED))
+		stackpaint(t);
 
 	/* do a reasonable initialization */
 	memset(&t->context.uc, 0, sizeof t->context.uc);
@@ -116,16 +283,9 @@ taskalloc(Task *task, void (*fn)(Task *, void*), void *arg)
 	return t;
 }
 
-int
-taskcreate(Task *task, void (*f)(Task *, void*), void *arg)
+static void
+taskinsert(ltctx *lt, Task *t)
 {
-	int id;
-	Task *t;
-	ltctx *lt = task->ltcontext;
-
-	t = taskalloc(task, f, arg);
-	id = t->id;
-
 	SCHED_XLOCK;
 
 	if(lt->nalltask%64 == 0){
@@ -137,26 +297,151 @@ taskcreate(Task *task, void (*f)(Task *, void*), void *arg)
 	lt->alltask[lt->nalltask++] = t;
 
 	SCHED_UNLOCK;
+}
+
+int
+taskcreate(Task *task, void (*f)(Task *, void*), void *arg)
+{
+	return taskcreateprio(task, TASKPRIONORMAL, f, arg);
+}
+
+int
+taskcreateprio(Task *task, int prio, void (*f)(Task *, void*), void *arg)
+{
+	int id;
+	Task *t;
+	ltctx *lt = task->ltcontext;
+
+	ASSERT(prio >= 0 && prio < TASKNPRIO, "taskcreateprio: bad priority %d",
+	    prio);
+
+	t = taskalloc(task, f, arg);
+	t->prio = prio;
+	id = t->id;
 
+	taskinsert(lt, t);
 	taskready(t);
 	return id;
 }
 
+/* takes effect the next time t is queued to run */
+void
+tasksetprio(Task *t, int prio)
+{
+	ASSERT(prio >= 0 && prio < TASKNPRIO, "tasksetprio: bad priority %d",
+	    prio);
+	t->prio = prio;
+}
+
+int
+taskprio(Task *t)
+{
+	return t->prio;
+}
+
+/*
+ * Joinable tasks. The child's Task (and stack) outlive it until taskjoin():
+ * the result sits in t->result and t->joiner is the rendezvous word. It
+ * holds nil while nobody waits, the waiting task once the joiner parks, or
+ * JOINDONE once the child has switched out for the last time. Whoever
+ * swaps second wakes the joiner, so no Rendez or allocation is involved.
+ */
+#define JOINDONE	((Task*)1)
+
+static void
+spawnstart(Task *t, void *arg)
+{
+	t->result = t->spawnfn(t, arg);
+}
+
+Task*
+taskspawn(Task *task, void *(*f)(Task *, void*), void *arg)
+{
+	Task *t;
+
+	t = taskalloc(task, spawnstart, arg);
+	t->spawnfn = f;
+	t->joinable = 1;
+
+	taskinsert(task->ltcontext, t);
+	taskready(t);
+	return t;
+}
+
+static void
+joinpark(Task *t, void *v)
+{
+	Task *child = v, *nobody = nil;
+
+	if(!__atomic_compare_exchange_n(&child->joiner, &nobody, t, false,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		taskready(t);	/* finished while we were switching out */
+}
+
+void*
+taskjoin(Task *t, Task *child)
+{
+	void *result;
+
+	ASSERT(child->joinable, "taskjoin: task %u not spawned", child->id);
+
+	if(__atomic_load_n(&child->joiner, __ATOMIC_ACQUIRE) != JOINDONE){
+		taskstate(t, "join %u", child->id);
+		taskpark(t, WAITJOIN, joinpark, child);
+	}
+	ASSERT(child->joiner == JOINDONE, "taskjoin: woken early");
+
+	result = child->result;
+	stackfree(child);
+	return result;
+}
+
+void
+taskjoinall(Task *t, Task **child, int n, void **result)
+{
+	int i;
+	void *r;
+
+	for(i=0; i<n; i++){
+		r = taskjoin(t, child[i]);
+		if(result)
+			result[i] = r;
+	}
+}
+
 void
 taskswitch(Task *t)
 {
+	t->switchat = cputicks();
 	contextswitch(&t->context, t->schedctx);
 }
 
+/*
+ * Switch away from t and, once its context is saved, run fn(t, arg) on the
+ * scheduler stack. Anything that may make t runnable again from another
+ * thread (queueing it somewhere, dropping a lock) belongs in fn; doing it
+ * before the switch lets another worker resume a half-saved context.
+ */
+void
+taskpark(Task *t, int wait, void (*fn)(Task *, void*), void *arg)
+{
+	t->wait = wait;
+	t->parkfn = fn;
+	t->parkarg = arg;
+	taskswitch(t);
+}
+
 void
 taskready(Task *t)
 {
-	ltctx *lt = t->ltcontext;
+	Pool *p = poolof(t);
 
 	t->ready = 1;
+	t->readyat = cputicks();
 
 	RUNQ_LOCK;
-	addtask(&lt->taskrunqueue, t);
+	addtask(&p->runq[t->node].q[t->prio], t);
+	__atomic_store_n(&p->nrunnable, p->nrunnable+1, __ATOMIC_RELAXED);
 	RUN_AVAIL;
 	RUNQ_UNLOCK;
 }
@@ -182,6 +467,20 @@ taskyield(Task *t)
 	return n;
 }
 
+/*
+ * Run fn(arg) on the worker thread's stack. The scheduler makes the call
+ * between two switches, and t counts as running throughout, so fn must
+ * not yield, block in taskmn or touch t.
+ */
+void*
+taskcallbig(Task *t, void *(*fn)(void*), void *arg)
+{
+	t->callfn = fn;
+	t->callarg = arg;
+	contextswitch(&t->context, t->schedctx);
+	return t->callret;
+}
+
 void
 taskexit(Task *t, int val)
 {
@@ -191,6 +490,7 @@ taskexit(Task *t, int val)
 	lt->taskexitval = val;
 	SCHED_UNLOCK;
 
+	localexit(t);
 	t->exiting = 1;
 	taskswitch(t);
 }
@@ -203,20 +503,175 @@ contextswitch(Context *from, Context *to)
 	ASSERT(rc >= 0, "swapcontext failed: %s", strerror(errno));
 }
 
+/*
+ * Strict priority with aging. Each dispatch from a higher class passes
+ * over every non-empty lower one; a class passed over RUNQ_AGE times in a
+ * row is served next regardless, so batch work still gets about one
+ * worker slot in RUNQ_AGE+1 under a flood of interactive tasks.
+ */
+static Task*
+runqpop(Runq *rq)
+{
+	int i, pick;
+	Task *t;
+
+	pick = -1;
+	for(i=0; i<TASKNPRIO; i++){
+		if(rq->q[i].head == nil)
+			continue;
+		if(pick < 0 || rq->skip[i] >= RUNQ_AGE){
+			pick = i;
+			if(rq->skip[i] >= RUNQ_AGE)
+				break;
+		}
+	}
+	if(pick < 0)
+		return nil;
+
+	for(i=pick+1; i<TASKNPRIO; i++)
+		if(rq->q[i].head)
+			rq->skip[i]++;
+	rq->skip[pick] = 0;
+
+	t = rq->q[pick].head;
+	deltask(&rq->q[pick], t);
+	return t;
+}
+
+/*
+ * Take the next task in pool p for a worker on node, stealing from the
+ * nearest other node if ours has nothing; a stolen task moves to our node.
+ * Called with p's run queue locked.
+ */
+static Task*
+runqget(ltctx *lt, Pool *p, int node)
+{
+	int i, n;
+	Task *t;
+
+	for(i=0; i<lt->nnode; i++){
+		n = lt->stealorder[node][i];
+		if((t = runqpop(&p->runq[n])) != nil){
+			t->node = node;
+			__atomic_store_n(&p->nrunnable, p->nrunnable-1,
+			    __ATOMIC_RELAXED);
+			return t;
+		}
+	}
+	return nil;
+}
+
+/*
+ * Accounting. cputicks() is the TSC; tickmult converts it to nanoseconds
+ * and is measured against the monotonic clock once at startup.
+ */
+static uvlong
+monons(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uvlong)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static uvlong
+tickcalibrate(void)
+{
+	uvlong t0, t1, n0, n1;
+
+	n0 = monons();
+	t0 = cputicks();
+	do
+		n1 = monons();
+	while(n1 - n0 < 1000000);
+	t1 = cputicks();
+	if(t1 <= t0)
+		return 1ULL<<32;
+	return ((n1-n0)<<32) / (t1-t0);
+}
+
+uvlong
+ticksns(ltctx *lt, uvlong ticks)
+{
+	return (ticks>>32)*lt->tickmult +
+	    (((ticks&0xffffffff)*lt->tickmult)>>32);
+}
+
+/* only the owning worker writes; readers sum racily */
+static void
+stathist(uvlong *h, uvlong ns)
+{
+	int i;
+
+	i = ns ? 63 - __builtin_clzll(ns) : 0;
+	if(i >= TASKHIST)
+		i = TASKHIST-1;
+	__atomic_store_n(&h[i], h[i]+1, __ATOMIC_RELAXED);
+}
+
+void
+taskstat(Task *t, Taskstat *st)
+{
+	ltctx *lt = t->ltcontext;
+
+	st->runns = ticksns(lt, t->runticks);
+	st->waitns = ticksns(lt, t->waitticks);
+	st->ndispatch = t->ndispatch;
+}
+
+void
+taskpoolstat(Task *t, Poolstat *ps)
+{
+	ltctx *lt = t->ltcontext;
+	Worker *w;
+	int i;
+
+	memset(ps, 0, sizeof *ps);
+	w = __atomic_load_n(&lt->workers, __ATOMIC_ACQUIRE);
+	for(; w; w = w->next){
+		ps->ndispatch += __atomic_load_n(&w->ndispatch, __ATOMIC_RELAXED);
+		for(i=0; i<TASKHIST; i++){
+			ps->qlat[i] += __atomic_load_n(&w->qlat[i], __ATOMIC_RELAXED);
+			ps->slice[i] += __atomic_load_n(&w->slice[i],
+			    __ATOMIC_RELAXED);
+		}
+	}
+	ps->stacktrimmed = __atomic_load_n(&lt->stacktrimmed, __ATOMIC_RELAXED);
+}
+
 static void
 taskscheduler(ltctx *lt)
 {
-	int i, suicide, nspawn, curthr;
+	int i, n, suicide, nspawn, curthr;
 	Task *t;
 	Context schedctx;
-
+	void (*parkfn)(Task *, void*);
+	void *(*callfn)(void*);
+	Task *joiner;
+	Worker *w;
+	Pool *p;
+	uvlong start, end;
+
+	w = curworker;
+	p = w->pool;
 	taskdebug(lt, nil, "scheduler enter");
 	for(;;){
+		if(__atomic_load_n(&lt->inbox, __ATOMIC_RELAXED) != nil)
+			inboxdrain(lt);
+
 		SCHED_XLOCK;
 
 		if(lt->nalltask == 0){
 			taskdebug(lt, nil, "no more tasks, bailing");
 			SCHED_UNLOCK;
+			/* the stalled workers won't notice by themselves */
+			n = __atomic_load_n(&lt->npool, __ATOMIC_ACQUIRE);
+			for(i=0; i<n; i++){
+				p = &lt->pools[i];
+				RUNQ_LOCK;
+				RUN_ALLDONE;
+				RUNQ_UNLOCK;
+			}
 			return;
 		}
 
@@ -225,23 +680,37 @@ taskscheduler(ltctx *lt)
 		RUNQ_LOCK;
 
 		while(true){
-			t = lt->taskrunqueue.head;
+			t = runqget(lt, p, w->node);
 			if(t)
 				break;
+			if(__atomic_load_n(&lt->nalltask, __ATOMIC_RELAXED) == 0)
+				break;
 
-			lt->nstalled++;
+			__atomic_store_n(&p->nstalled, p->nstalled+1,
+			    __ATOMIC_RELAXED);
+			/* a foreign post either sees us stalled or we see it */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&lt->inbox, __ATOMIC_RELAXED) != nil){
+				__atomic_store_n(&p->nstalled, p->nstalled-1,
+				    __ATOMIC_RELAXED);
+				break;
+			}
 
 			POOL_LOCK;
-			curthr = lt->curthr;
-			if(curthr != lt->nthr){
+			curthr = p->curthr;
+			if(curthr != p->nthr){
 				POOL_UNLOCK;
-				lt->nstalled--;
+				__atomic_store_n(&p->nstalled, p->nstalled-1,
+				    __ATOMIC_RELAXED);
 				RUNQ_UNLOCK;
 				goto adjthreads;
 			}
 			POOL_UNLOCK;
 
-			if(lt->nstalled == curthr){
+			/* with more pools, work may come from the others */
+			if(p->nstalled == curthr &&
+			    __atomic_load_n(&lt->npool, __ATOMIC_RELAXED) == 1 &&
+			    !__atomic_load_n(&lt->foreign, __ATOMIC_RELAXED)){
 				/* all other threads must be stalled as well,
 				   so no need for locks */
 				ASSERT(false, "No tasks (of %d) are runnable!",
@@ -249,12 +718,13 @@ taskscheduler(ltctx *lt)
 			}
 
 			RUN_STALLED;
-			lt->nstalled--;
+			__atomic_store_n(&p->nstalled, p->nstalled-1,
+			    __ATOMIC_RELAXED);
 		}
 
-		deltask(&lt->taskrunqueue, t);
-
 		RUNQ_UNLOCK;
+		if(t == nil)
+			continue;
 
 		SCHED_XLOCK;
 
@@ -266,12 +736,38 @@ taskscheduler(ltctx *lt)
 
 		taskdebug(lt, t, "run %d (%s)", t->id, t->name);
 
+		if(__atomic_load_n(&p->slicens, __ATOMIC_RELAXED))
+			__atomic_store_n(&w->since, nsec(), __ATOMIC_RELAXED);
+		/* pairs with the acquire in preemptmon() */
+		__atomic_store_n(&w->gen, w->gen+1, __ATOMIC_RELEASE);
+
+		start = cputicks();
+		t->runat = start;
+		t->wait = WAITNONE;
+		t->waitticks += start - t->readyat;
+		t->ndispatch++;
+		stathist(w->qlat, ticksns(lt, start - t->readyat));
+
 		t->schedctx = &schedctx;
+		curtask = t;
 		contextswitch(&schedctx, &t->context);
+		curtask = nil;
 #if 0
 print("back in scheduler\n");
 #endif
+		/* taskcallbig(): make the call here and go straight back */
+		while((callfn = t->callfn) != nil){
+			t->callfn = nil;
+			t->callret = callfn(t->callarg);
+			contextswitch(&schedctx, &t->context);
+		}
 		t->schedctx = NULL;
+		__atomic_store_n(&w->since, 0, __ATOMIC_RELAXED);
+
+		end = cputicks();
+		t->runticks += end - start;
+		stathist(w->slice, ticksns(lt, end - start));
+		__atomic_store_n(&w->ndispatch, w->ndispatch+1, __ATOMIC_RELAXED);
 
 		/* if the task is exiting, it won't be on the run queue for
 		 * another thread to pick up anyway */
@@ -281,11 +777,35 @@ print("back in scheduler\n");
 			i = t->alltaskslot;
 			lt->alltask[i] = lt->alltask[--lt->nalltask];
 			lt->alltask[i]->alltaskslot = i;
-			free(t->stk);
+			n = lt->nalltask;
 
 			SCHED_UNLOCK;
+
+			/* fdtask may be the only one left, asleep in poll */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if(n == 1 && lt->startedfdtask)
+				pollwakeup(lt);
+
+			if(t->stkpainted)
+				stackprofexit(lt, t);
+			taskarenareset(t, nil);
+
+			/* t lives on its own stack; don't touch it after this */
+			if(!t->joinable)
+				stackfree(t);
+			else{
+				/* the joiner frees the stack */
+				joiner = __atomic_exchange_n(&t->joiner, JOINDONE,
+				    __ATOMIC_ACQ_REL);
+				if(joiner)
+					taskready(joiner);
+			}
 		}else if(t->readyout){
 			taskready(t);
+		}else if((parkfn = t->parkfn) != nil){
+			/* t may be running elsewhere as soon as this returns */
+			t->parkfn = nil;
+			parkfn(t, t->parkarg);
 		}
 
 adjthreads:
@@ -293,19 +813,19 @@ adjthreads:
 		suicide = 0;
 		nspawn = 0;
 		POOL_LOCK;
-		if(lt->curthr > lt->nthr){
-			lt->curthr--;
+		if(p->curthr > p->nthr){
+			p->curthr--;
 			suicide = 1;
-		}else if(lt->curthr < lt->nthr){
-			nspawn = lt->nthr - lt->curthr;
-			lt->curthr = lt->nthr;
+		}else if(p->curthr < p->nthr){
+			nspawn = p->nthr - p->curthr;
+			p->curthr = p->nthr;
 		}
 		POOL_UNLOCK;
 
 		if(suicide)
 			return;
 		if(nspawn)
-			spawn(nspawn-1, lt);
+			spawn(nspawn-1, lt, p);
 	}
 }
 
@@ -366,6 +886,7 @@ taskmainstart(Task *t, void *v)
 struct workerarg
 {
 	ltctx*	lt;
+	Pool*	pool;
 	int	nleft;
 };
 
@@ -374,13 +895,20 @@ workerthr(void *arg)
 {
 	struct workerarg *wa;
 	ltctx *lt;
+	Pool *p;
 	int childleft[2] = { 0, 0}, left, thisleft;
 
 	wa = (struct workerarg *)arg;
 	lt = wa->lt;
+	p = wa->pool;
 	left = wa->nleft;
 	free(arg);
 
+	workerid = __atomic_fetch_add(&lt->nworkerid, 1, __ATOMIC_RELAXED);
+	curworker = workerattach(lt);
+	__atomic_store_n(&curworker->pool, p, __ATOMIC_RELAXED);
+	workerpin(lt, curworker);
+
 	/* the following 10 lines try to bring up threadpool in parallel */
 	thisleft = imin(left, 2);
 	left -= thisleft;
@@ -389,44 +917,246 @@ workerthr(void *arg)
 		childleft[1] = left - childleft[0];
 	}
 	if(thisleft > 0)
-		spawn(childleft[0], lt);
+		spawn(childleft[0], lt, p);
 	if(thisleft > 1)
-		spawn(childleft[1], lt);
+		spawn(childleft[1], lt, p);
 
 	taskscheduler(lt);
 	/* no more tasks want to run */
 
+	workerunpin(lt, curworker);
+	__atomic_store_n(&curworker->live, 0, __ATOMIC_RELEASE);
+	curworker = nil;
+
+	/* the last time this thread touches lt */
+	lockmtx(&lt->livelock);
+	if(--lt->nlive == 0)
+		condnotify(&lt->nolive);
+	unlockmtx(&lt->livelock);
 	return nil;
 }
 
 /*
- * Spawns left+1 threads. ex, to spawn 4 threads:
+ * Spawns left+1 threads for pool p. ex, to spawn 4 threads:
  *
- * spawn(3, lt);
+ * spawn(3, lt, p);
  */
 static void
-spawn(int left, ltctx *lt)
+spawn(int left, ltctx *lt, Pool *p)
 {
 	struct workerarg *wa;
 	int r;
 	pthread_t pt;
+	pthread_attr_t attr;
+	size_t sz;
 
 	wa = malloc(sizeof *wa);
 	ASSERT(wa, "oom");
 	wa->nleft = left;
 	wa->lt = lt;
+	wa->pool = p;
+
+	/* taskcallbig() runs on this stack */
+	pthread_attr_init(&attr);
+	if(pthread_attr_getstacksize(&attr, &sz) == 0 && sz < WORKERSTACK)
+		pthread_attr_setstacksize(&attr, WORKERSTACK);
+
+	lockmtx(&lt->livelock);
+	lt->nlive++;
+	unlockmtx(&lt->livelock);
+	r = pthread_create(&pt, &attr, workerthr, (void*)wa);
+	ASSERT(r==0, "pthread_create: %s", strerror(r));
+	pthread_attr_destroy(&attr);
+	pthread_detach(pt);
+}
+
+/*
+ * Placement. Node numbers come from sysfs (cpuN/nodeM links) and the
+ * steal order from each node's distance row; anything missing just means
+ * one node and numeric order.
+ */
+static int
+cpunode(int cpu)
+{
+	char path[64];
+	DIR *d;
+	struct dirent *de;
+	int node;
+
+	node = 0;
+	snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+	if((d = opendir(path)) == nil)
+		return 0;
+	while((de = readdir(d)) != nil){
+		if(strncmp(de->d_name, "node", 4) == 0 &&
+		    isdigit((uchar)de->d_name[4])){
+			node = atoi(de->d_name+4);
+			break;
+		}
+	}
+	closedir(d);
+	return node % MAXNODE;
+}
+
+static void
+nodedistance(int node, int *dist)
+{
+	char path[64];
+	FILE *f;
+	int i;
+
+	for(i=0; i<MAXNODE; i++)
+		dist[i] = i == node ? 0 : 100 + (i - node + MAXNODE) % MAXNODE;
+
+	snprintf(path, sizeof path, "/sys/devices/system/node/node%d/distance",
+	    node);
+	if((f = fopen(path, "r")) == nil)
+		return;
+	for(i=0; i<MAXNODE && fscanf(f, "%d", &dist[i]) == 1; i++)
+		;
+	fclose(f);
+	dist[node] = 0;	/* always look at home first */
+}
+
+static void
+placeinit(ltctx *lt, Taskpoolattr *attr)
+{
+	int i, j, k, n, dist[MAXNODE];
+#ifdef __linux__
+	cpu_set_t set;
+#endif
+
+	lt->nnode = 1;
+	if(attr->ncpu > 0){
+		lt->ncpu = attr->ncpu;
+		lt->cpus = malloc(lt->ncpu * sizeof lt->cpus[0]);
+		ASSERT(lt->cpus, "oom");
+		memmove(lt->cpus, attr->cpus, lt->ncpu * sizeof lt->cpus[0]);
+	}
+#ifdef __linux__
+	else if(attr->numa && sched_getaffinity(0, sizeof set, &set) == 0){
+		lt->cpus = malloc(CPU_COUNT(&set) * sizeof lt->cpus[0]);
+		ASSERT(lt->cpus, "oom");
+		for(i=0; i<CPU_SETSIZE; i++)
+			if(CPU_ISSET(i, &set))
+				lt->cpus[lt->ncpu++] = i;
+	}
+#endif
+
+	if(lt->ncpu > 0){
+		lt->cpunode = malloc(lt->ncpu * sizeof lt->cpunode[0]);
+		ASSERT(lt->cpunode, "oom");
+		lt->cpuload = calloc(lt->ncpu, sizeof lt->cpuload[0]);
+		ASSERT(lt->cpuload, "oom");
+		for(i=0; i<lt->ncpu; i++){
+			lt->cpunode[i] = attr->numa ? cpunode(lt->cpus[i]) : 0;
+			if(lt->cpunode[i] >= lt->nnode)
+				lt->nnode = lt->cpunode[i]+1;
+		}
+	}
+
+	/* stealorder[i] is every node sorted by distance from i */
+	for(i=0; i<lt->nnode; i++){
+		nodedistance(i, dist);
+		n = 0;
+		for(j=0; j<lt->nnode; j++){
+			for(k=n; k>0 && dist[lt->stealorder[i][k-1]] > dist[j]; k--)
+				lt->stealorder[i][k] = lt->stealorder[i][k-1];
+			lt->stealorder[i][k] = j;
+			n++;
+		}
+	}
+}
+
+/*
+ * Workers come and go (taskpoolsize(), new pools), so each takes the
+ * CPU with the fewest live workers on it rather than one derived from
+ * its id, which only grows.
+ */
+static void
+workerpin(ltctx *lt, Worker *w)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	int r;
+#endif
+	int i, j;
+
+	w->node = 0;
+	w->cpu = -1;
+	if(lt->ncpu == 0)
+		return;
+
+	CTL_LOCK;
+	i = 0;
+	for(j=1; j<lt->ncpu; j++)
+		if(lt->cpuload[j] < lt->cpuload[i])
+			i = j;
+	lt->cpuload[i]++;
+	CTL_UNLOCK;
+
+	w->cpu = i;
+	w->node = lt->cpunode[i];
+#ifdef __linux__
+	r = pthread_getaffinity_np(pthread_self(), sizeof w->mask, &w->mask);
+	ASSERT(r==0, "save worker cpu mask: %s", strerror(r));
+	CPU_ZERO(&set);
+	CPU_SET(lt->cpus[i], &set);
+	r = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+	ASSERT(r==0, "pin worker to cpu %d: %s", lt->cpus[i], strerror(r));
+#endif
+}
 
-	r = pthread_create(&pt, NULL, workerthr, (void*)wa);
-	ASSERT(r==0, "pthread_create: %s", strerror(errno));
+static void
+workerunpin(ltctx *lt, Worker *w)
+{
+#ifdef __linux__
+	int r;
+#endif
+
+	if(w->cpu < 0)
+		return;
+#ifdef __linux__
+	/* the thread may be libtaskmnattr()'s caller, which lives on */
+	r = pthread_setaffinity_np(pthread_self(), sizeof w->mask, &w->mask);
+	ASSERT(r==0, "restore worker cpu mask: %s", strerror(r));
+#endif
+	CTL_LOCK;
+	lt->cpuload[w->cpu]--;
+	CTL_UNLOCK;
+	w->cpu = -1;
+}
+
+static void
+poolinit(Pool *p, char *name, int nthr)
+{
+	snprintf(p->name, sizeof p->name, "%s", name);
+	p->runqueuelock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	p->workavail = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	rendezinit(&p->blockedth);
+	p->nthr = nthr;
+	p->curthr = nthr;
 }
 
 int
 libtaskmn(void (*f)(Task *lt, void *arg), void *arg, int nthr)
+{
+	Taskpoolattr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.nthr = nthr;
+	return libtaskmnattr(f, arg, &attr);
+}
+
+int
+libtaskmnattr(void (*f)(Task *lt, void *arg), void *arg, Taskpoolattr *attr)
 {
 	ltctx *ltcontext;
 	Task faketask;
 	struct workerarg *wa;
-	int rc;
+	Worker *w;
+	Pool *p;
+	int rc, nthr;
 
 	ltcontext = malloc(sizeof *ltcontext);
 	ASSERT(ltcontext, "OOM");
@@ -434,29 +1164,37 @@ libtaskmn(void (*f)(Task *lt, void *arg), void *arg, int nthr)
 
 	ltcontext->polllock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
 	ltcontext->sxlock = (pthread_rwlock_t)PTHREAD_RWLOCK_INITIALIZER;
-	ltcontext->runqueuelock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
-	ltcontext->workavail = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
-	rendezinit(&ltcontext->blockedth);
+	ltcontext->livelock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	ltcontext->nolive = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	ltcontext->ctllock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	ltcontext->stackproflock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
 
 	ltcontext->taskmain = f;
 	ltcontext->taskmainarg = arg;
 	if(getenv("TASKMN_SPAM"))
 		ltcontext->log = 1;
+	placeinit(ltcontext, attr);
+	ltcontext->tickmult = tickcalibrate();
+	nthr = attr->nthr;
+	p = &ltcontext->pools[0];
+	poolinit(p, "main", nthr);
+	ltcontext->npool = 1;
 
 	memset(&faketask, 0, sizeof faketask);
 	faketask.ltcontext = ltcontext;
 	taskcreate(&faketask, taskmainstart, nil);
 
-	ltcontext->nthr = nthr;
-	ltcontext->curthr = nthr;
-
 	while(true){
 		wa = malloc(sizeof *wa);  /* freed by caller */
 		ASSERT(wa, "oom");
 		wa->nleft = nthr-1/*we are already a thread!*/;
 		wa->lt = ltcontext;
+		wa->pool = p;
 
 		/* join the proletariat */
+		lockmtx(&ltcontext->livelock);
+		ltcontext->nlive++;
+		unlockmtx(&ltcontext->livelock);
 		workerthr(wa);
 
 		/* this thread may accidentally suicide; if so, restart it
@@ -471,13 +1209,39 @@ libtaskmn(void (*f)(Task *lt, void *arg), void *arg, int nthr)
 			break;
 
 		/* this thread didn't really die */
-		lockmtx(&ltcontext->blockedth.l);
-		ltcontext->curthr++;
-		unlockmtx(&ltcontext->blockedth.l);
+		POOL_LOCK;
+		p->curthr++;
+		POOL_UNLOCK;
 	}
 
+	/* the other workers are on their way out; don't pull lt from under them */
+	lockmtx(&ltcontext->livelock);
+	while(ltcontext->nlive > 0)
+		condwaittime(&ltcontext->nolive, &ltcontext->livelock, 1000/*ms*/);
+	unlockmtx(&ltcontext->livelock);
+	if(ltcontext->startedfdtask){
+		close(ltcontext->pollwake[0]);
+		if(ltcontext->pollwake[1] != ltcontext->pollwake[0])
+			close(ltcontext->pollwake[1]);
+	}
+
+	taskdumpstop(ltcontext);
+	stackprofstop(ltcontext);
+	inboxstop(ltcontext);
+	if(ltcontext->monitoron){
+		__atomic_store_n(&ltcontext->monitorexit, 1, __ATOMIC_RELAXED);
+		pthread_join(ltcontext->monitor, nil);
+	}
+	while((w = ltcontext->workers) != nil){
+		ltcontext->workers = w->next;
+		arenadrain(w);
+		free(w);
+	}
 	if(ltcontext->alltask)
 		free(ltcontext->alltask);
+	free(ltcontext->cpus);
+	free(ltcontext->cpunode);
+	free(ltcontext->cpuload);
 	rc = ltcontext->taskexitval;
 	free(ltcontext);
 	return rc;
@@ -513,6 +1277,44 @@ deltask(Tasklist *l, Task *t)
 		l->tail = t->prev;
 }
 
+void
+addwaiter(Waitlist *l, Waiter *w)
+{
+	if(l->tail){
+		l->tail->next = w;
+		w->prev = l->tail;
+	}else{
+		l->head = w;
+		w->prev = nil;
+	}
+	l->tail = w;
+	w->next = nil;
+}
+
+void
+delwaiter(Waitlist *l, Waiter *w)
+{
+	if(w->prev)
+		w->prev->next = w->next;
+	else
+		l->head = w->next;
+	if(w->next)
+		w->next->prev = w->prev;
+	else
+		l->tail = w->prev;
+}
+
+/*
+ * Small integer naming the worker thread we are running on. Ids are handed
+ * out in thread start order and are not reused; a task may see a different
+ * one after any call that can switch.
+ */
+int
+taskworker(void)
+{
+	return workerid;
+}
+
 unsigned int
 taskid(Task *t)
 {
@@ -522,7 +1324,7 @@ taskid(Task *t)
 void
 taskblocking(Task *task)
 {
-	ltctx *lt = task->ltcontext;
+	Pool *p = poolof(task);
 
 	ASSERT(!task->blocked, "double-blocked task!");
 	task->blocked = 1;
@@ -530,13 +1332,15 @@ taskblocking(Task *task)
 	POOL_LOCK;
 
 	while(true){
-		if((lt->nblocking+1)*100/lt->curthr <= LT_BLOCKED_THRESH){
+		/* a lone worker has to be allowed to block, or fdtask never polls */
+		if(p->nblocking == 0 ||
+		    (p->nblocking+1)*100/p->curthr <= LT_BLOCKED_THRESH){
 			/* there aren't too many blocking threads; go for it. */
-			lt->nblocking++;
+			p->nblocking++;
 			goto out;
 		}
 
-		tasksleep(task, &lt->blockedth);
+		tasksleep(task, &p->blockedth);
 	}
 
 out:
@@ -546,25 +1350,215 @@ out:
 void
 tasknonblocking(Task *task)
 {
-	ltctx *lt = task->ltcontext;
+	Pool *p = poolof(task);
 
 	ASSERT(task->blocked, "double-unblocked task!");
 	task->blocked = 0;
 
 	POOL_LOCK;
 
-	lt->nblocking--;
-	taskwakeup(&lt->blockedth);
+	p->nblocking--;
+	taskwakeup(&p->blockedth);
 
 	POOL_UNLOCK;
 }
 
 void
 taskpoolsize(Task *task, int nthr)
+{
+	taskpoolresize(task, task->pool, nthr);
+}
+
+/*
+ * Scheduling domains. Pools are never destroyed; their threads go away
+ * with the context. Migration is a yield that requeues the task on the
+ * other pool's run queue instead of its own.
+ */
+int
+taskpoolcreate(Task *task, char *name, int nthr)
+{
+	ltctx *lt = task->ltcontext;
+	Pool *p;
+	int id;
+
+	ASSERT(nthr > 0, "taskpoolcreate: %d threads", nthr);
+	/* a truncated name could never be found again */
+	if(strlen(name) >= sizeof lt->pools[0].name)
+		return -1;
+	CTL_LOCK;
+	id = lt->npool;
+	if(id == MAXPOOL || taskpoolfind(task, name) >= 0){
+		CTL_UNLOCK;
+		return -1;
+	}
+	p = &lt->pools[id];
+	poolinit(p, name, nthr);
+	__atomic_store_n(&lt->npool, id+1, __ATOMIC_RELEASE);
+	CTL_UNLOCK;
+
+	spawn(nthr-1, lt, p);
+	return id;
+}
+
+int
+taskpoolfind(Task *task, char *name)
+{
+	ltctx *lt = task->ltcontext;
+	int i, n;
+
+	n = __atomic_load_n(&lt->npool, __ATOMIC_ACQUIRE);
+	for(i=0; i<n; i++)
+		if(strcmp(lt->pools[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+void
+taskpoolresize(Task *task, int pool, int nthr)
 {
 	ltctx *lt = task->ltcontext;
+	Pool *p;
 
+	ASSERT(pool >= 0 && pool < __atomic_load_n(&lt->npool, __ATOMIC_ACQUIRE),
+	    "taskpoolresize: no pool %d", pool);
+	p = &lt->pools[pool];
 	POOL_LOCK;
-	lt->nthr = nthr;
+	p->nthr = nthr;
 	POOL_UNLOCK;
 }
+
+int
+taskgetpool(Task *t)
+{
+	return t->pool;
+}
+
+int
+taskmigrate(Task *t, int pool)
+{
+	ltctx *lt = t->ltcontext;
+	int old;
+
+	ASSERT(pool >= 0 && pool < __atomic_load_n(&lt->npool, __ATOMIC_ACQUIRE),
+	    "taskmigrate: no pool %d", pool);
+	ASSERT(!t->blocked, "taskmigrate: task %u is blocking", t->id);
+	old = t->pool;
+	if(pool == old)
+		return old;
+
+	/* the scheduler's taskready() puts us on the new pool's queue */
+	t->pool = pool;
+	t->readyout = 1;
+	taskstate(t, "migrate");
+	taskswitch(t);
+	return old;
+}
+
+/*
+ * Preemption. The scheduler stamps the worker's Worker with the dispatch
+ * time and bumps its generation; the monitor thread copies the generation
+ * into w->preempt once a dispatch overstays its slice. A stale flag names
+ * an old generation and so can never hit the task that runs next.
+ */
+static Worker*
+workerattach(ltctx *lt)
+{
+	Worker *w;
+	int dead;
+
+	for(w = __atomic_load_n(&lt->workers, __ATOMIC_ACQUIRE); w; w = w->next){
+		dead = 0;
+		if(__atomic_compare_exchange_n(&w->live, &dead, 1, false,
+		    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return w;
+	}
+
+	w = malloc(sizeof *w);
+	ASSERT(w, "oom");
+	memset(w, 0, sizeof *w);
+	w->live = 1;
+	w->next = __atomic_load_n(&lt->workers, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&lt->workers, &w->next, w, true,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return w;
+}
+
+static void*
+preemptmon(void *arg)
+{
+	ltctx *lt = arg;
+	struct timespec ts;
+	uvlong slice, gen, since, now, period;
+	Worker *w;
+	Pool *p;
+	int i, n;
+
+	while(!__atomic_load_n(&lt->monitorexit, __ATOMIC_RELAXED)){
+		/* check twice per slice of the pool with the shortest */
+		period = 0;
+		n = __atomic_load_n(&lt->npool, __ATOMIC_ACQUIRE);
+		for(i=0; i<n; i++){
+			slice = __atomic_load_n(&lt->pools[i].slicens,
+			    __ATOMIC_RELAXED);
+			if(slice && (period == 0 || slice/2 < period))
+				period = slice/2;
+		}
+		if(period == 0)
+			period = 100*1000*1000;
+		if(period < 50*1000)
+			period = 50*1000;
+		ts.tv_sec = period / 1000000000;
+		ts.tv_nsec = period % 1000000000;
+		nanosleep(&ts, nil);
+
+		now = nsec();
+		w = __atomic_load_n(&lt->workers, __ATOMIC_ACQUIRE);
+		for(; w; w = w->next){
+			/* slicing off, or nobody in its pool to give the worker to */
+			p = __atomic_load_n(&w->pool, __ATOMIC_RELAXED);
+			if(p == nil)
+				continue;
+			slice = __atomic_load_n(&p->slicens, __ATOMIC_RELAXED);
+			if(slice == 0 ||
+			    __atomic_load_n(&p->nrunnable, __ATOMIC_RELAXED) == 0)
+				continue;
+			gen = __atomic_load_n(&w->gen, __ATOMIC_ACQUIRE);
+			since = __atomic_load_n(&w->since, __ATOMIC_RELAXED);
+			if(since != 0 && now > since && now - since >= slice)
+				__atomic_store_n(&w->preempt, gen, __ATOMIC_RELAXED);
+		}
+	}
+	return nil;
+}
+
+void
+taskpoolslice(Task *task, uint usec)
+{
+	ltctx *lt = task->ltcontext;
+	int r;
+
+	__atomic_store_n(&poolof(task)->slicens, (uvlong)usec*1000,
+	    __ATOMIC_RELAXED);
+	CTL_LOCK;
+	if(usec && !lt->monitoron){
+		r = pthread_create(&lt->monitor, nil, preemptmon, lt);
+		ASSERT(r==0, "pthread_create: %s", strerror(r));
+		lt->monitoron = 1;
+	}
+	CTL_UNLOCK;
+}
+
+int
+taskpreemptpoint(Task *t)
+{
+	Worker *w = curworker;
+
+	if(w == nil || __atomic_load_n(&w->preempt, __ATOMIC_RELAXED) != w->gen)
+		return 0;
+
+	t->readyout = 1;
+	taskstate(t, "preempted");
+	taskswitch(t);
+	return 1;
+}
@@ -1,6 +1,9 @@
 /* Copyright (c) 2005-2006 Russ Cox, MIT; see COPYRIGHT */
 
 #include <sys/cdefs.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include <sys/poll.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -68,6 +71,16 @@ struct Context
 };
 
 typedef struct Libtaskcontext Libtaskcontext;
+typedef struct Stackname Stackname;
+typedef struct Arenachunk Arenachunk;
+typedef struct Post Post;
+typedef struct Pool Pool;
+
+enum
+{
+	MAXTASKKEY = 256,
+	TASKLOCALINLINE = 8	/* taskgetlocal() slots in the Task itself */
+};
 
 struct Task
 {
@@ -80,7 +93,6 @@ struct Task
 	Task	*prev;
 	/* end locked */
 	Context	context;
-	uvlong	alarmtime;
 	uint	id;
 	uchar	*stk;
 	uint	stksize;
@@ -94,31 +106,230 @@ struct Task
 	Libtaskcontext *ltcontext;
 	Context *schedctx;
 	int	blocked;
+	int	prio;	/* run queue to use; see taskcreateprio() */
+	int	node;	/* NUMA node whose run queue t goes on */
+	int	pool;	/* index into ltcontext->pools; see taskmigrate() */
+	/* accounting, in cputicks() */
+	uvlong	readyat;
+	uvlong	runticks;
+	uvlong	waitticks;
+	uvlong	ndispatch;
+	/* for taskdump() */
+	int	wait;	/* what a parked task waits for: WAITFD etc. */
+	uvlong	runat;	/* cputicks() at the last dispatch */
+	uvlong	switchat;	/* cputicks() at the last switch out */
+	uint	stkmapsize;	/* nonzero if stk was mmapped; see stackalloc() */
+	int	stkpainted;	/* see taskstackprof() */
+	uvlong	trimat;	/* switchat when last trimmed; see polltrim() */
+	/* taskmalloc(); newest chunk first */
+	Arenachunk	*arena;
+	Arenachunk	*arenabig;	/* one allocation each */
+	/* taskgetlocal(); keys past the inline ones in localmore */
+	void	*local[TASKLOCALINLINE];
+	void	**localmore;
+	int	nlocalmore;
+	/* taskcallbig(); run by the scheduler between two switches */
+	void	*(*callfn)(void*);
+	void	*callarg;
+	void	*callret;
+	/* run by the scheduler once the task has switched out; see taskpark() */
+	void	(*parkfn)(Task *, void*);
+	void	*parkarg;
+	/* taskspawn()/taskjoin() */
+	int	joinable;
+	void	*(*spawnfn)(Task *, void*);
+	void	*result;
+	Task	*joiner;
+};
+
+/*
+ * A Waiter stands in for a parked task on a queue that cannot use the
+ * task's own next/prev links: Rendez, channel and poller queues. It usually
+ * lives on the parked task's stack. A task in taskselect() has one per
+ * alternative, all pointing at the same Sel.
+ */
+typedef struct Waiter Waiter;
+typedef struct Sel Sel;
+
+struct Waiter
+{
+	Task	*task;
+	Waiter	*next;
+	Waiter	*prev;
+	void	*v;	/* value buffer for a direct handoff */
+	int	done;	/* dequeued (and woken, unless it lost a select) */
+	Sel	*sel;	/* nil unless part of a taskselect() */
+	int	idx;	/* index into the Alt array */
+	/* poller registrations */
+	int	fd;	/* -1 for a timer */
+	short	bits;
+	uvlong	alarmtime;
 };
 
+struct Sel
+{
+	Task	*task;
+	int	won;	/* index of the winning alternative, or -1 */
+	int	pending;	/* see waiterwake() */
+	Alt	*alt;
+	Waiter	*w;
+	int	n;
+};
+
+/*
+ * One per worker thread, linked on lt->workers for the preemption monitor
+ * (see taskpoolslice()). Nodes are recycled when a thread exits, never
+ * freed before the context is.
+ */
+typedef struct Worker Worker;
+
+struct Worker
+{
+	uvlong	gen;	/* bumped on every dispatch */
+	uvlong	since;	/* nsec() at dispatch; 0 while idle or slicing is off */
+	uvlong	preempt;	/* set to gen once that dispatch is over its slice */
+	int	node;
+	int	cpu;	/* index into lt->cpus; -1 if not pinned */
+#ifdef __linux__
+	cpu_set_t	mask;	/* affinity before workerpin() */
+#endif
+	Pool	*pool;	/* the one it takes tasks from */
+	int	live;
+	Worker	*next;
+
+	/* scheduler accounting, written only by the owning thread */
+	uvlong	ndispatch;
+	uvlong	qlat[TASKHIST];	/* run queue wait, log2 ns buckets */
+	uvlong	slice[TASKHIST];	/* time run per dispatch, likewise */
+
+	/* spare taskmalloc() chunks, touched only by the owning thread */
+	Arenachunk	*chunks;
+	int	nchunks;
+} __aligned(64);
+
+extern __thread Worker	*curworker;
+
+void	arenadrain(Worker*);
+
+void	addwaiter(Waitlist*, Waiter*);
+void	delwaiter(Waitlist*, Waiter*);
+bool	waiterwake(Waiter*);
+
+void	qlockmorph(QLock*, Task*);
+
 void	taskready(Task*);
 void	taskswitch(Task *);
+int	taskworker(void);
+void	taskpark(Task *, int, void (*)(Task *, void*), void*);
+extern __thread Task	*curtask;	/* the dispatched task; nil in the scheduler */
+uvlong	ticksns(Libtaskcontext*, uvlong);
+void	taskdumpstop(Libtaskcontext*);
+uintptr_t	tasksp(Task*);
+uvlong	stacktrim(Task*);
+void	stackpaint(Task*);
+long	stackhighwater(Task*);
+void	stackprofexit(Libtaskcontext*, Task*);
+void	stackprofstop(Libtaskcontext*);
+void	stackscanbegin(Libtaskcontext*);
+void	stackscanend(Libtaskcontext*);
+void	localexit(Task*);
+void	inboxdrain(Libtaskcontext*);
+void	inboxstop(Libtaskcontext*);
+
+/* Task.wait; see taskdump() */
+enum
+{
+	WAITNONE,
+	WAITFD,
+	WAITTIMER,
+	WAITRENDEZ,
+	WAITLOCK,
+	WAITCHAN,
+	WAITSELECT,
+	WAITSYNC,	/* Sem, WaitGroup, Barrier */
+	WAITJOIN
+};
 
 void	addtask(Tasklist*, Task*);
 void	deltask(Tasklist*, Task*);
 
+uvlong	nsec(void);
+
+void	startfdtask(Task*);
+short	fdwaitbits(char);
+void	pollpush(Libtaskcontext*, Waiter*);
+void	pollcancel(Libtaskcontext*, Waiter*);
+void	pollwakeup(Libtaskcontext*);
+
 enum
 {
-	MAXFD = 1024
+	MAXFD = 1024,
+	MAXNODE = 16,
+	WORKERSTACK = 8*1024*1024,	/* minimum; see taskcallbig() */
+	TRIMGUARD = 4096,	/* left below sp by stacktrim() */
+	ARENAALIGN = 16,
+	ARENACHUNK = 16*1024,
+	ARENACACHE = 64,	/* chunks kept per worker */
+	MAXPOOL = 8	/* see taskpoolcreate() */
+};
+
+/* one per NUMA node (just runq[0] unless Taskpoolattr.numa is set) */
+typedef struct Runq Runq;
+
+struct Runq
+{
+	Tasklist q[TASKNPRIO];
+	uint	skip[TASKNPRIO];	/* dispatches passed over; see runqget() */
+};
+
+/*
+ * A scheduling domain: its own worker threads, run queues and sizing. A
+ * task is queued on the pool named by Task.pool and only that pool's
+ * workers run it. pools[0] is the one libtaskmn() starts.
+ */
+struct Pool
+{
+	char	name[32];
+
+	/* ready queue; protected by runqueuelock */
+	pthread_mutex_t runqueuelock __aligned(64);
+	pthread_cond_t workavail;
+	Runq runq[MAXNODE];
+	int nrunnable;  /* tasks on all run queues; read unlocked by preemptmon */
+	int nstalled;  /* written locked, read unlocked by taskpost() etc. */
+	/* end locked */
+
+	uvlong slicens;  /* atomic; 0 means off; see taskpoolslice() */
+
+	/* threadpool management; protected by blockedth.l */
+	struct Rendez blockedth __aligned(64);
+	int curthr;
+	int nthr;
+	int nblocking;
+#define LT_BLOCKED_THRESH 75/* percent */
+	/* end locked */
 };
 
 struct Libtaskcontext
 {
-	/* protected by polllock */
+	/* protected by polllock; only fdtask takes it, and never across poll */
 	pthread_mutex_t polllock;
-	struct pollfd pollfd[MAXFD];
-	Task *polltask[MAXFD];
-	Tasklist sleeping;
+	struct pollfd pollfd[MAXFD];	/* pollfd[0] is pollwake[0] */
+	Waiter *pollw[MAXFD];	/* nil for a cancelled slot */
+	Waitlist sleeping;
 	int npollfd;
-	int nwaiters;
-	int pollwake[2];
 	/* end polllock */
 
+	/* taskpost(); lock-free push from any thread, drained by workers */
+	Post *inbox __aligned(64);
+	int foreign;  /* taskcontext() was called; see taskscheduler() */
+
+	/* fd and timer registrations; lock-free push, drained by fdtask */
+	Waiter *pollq __aligned(64);
+	int pollblocked;  /* fdtask is in (or about to enter) poll */
+	int pollkicked;   /* a wakeup is already in flight */
+	int pollwake[2];  /* eventfd (both ends) or pipe; set once */
+
 	/* scheduling stuff; protected by sxlock */
 	pthread_rwlock_t sxlock __aligned(64);
 	int tasknswitch;
@@ -135,22 +346,80 @@ struct Libtaskcontext
 
 	int log;  /* set once at initialization */
 
-	/* ready queue; protected by runqueuelock */
-	pthread_mutex_t runqueuelock __aligned(64);
-	pthread_cond_t workavail;
-	Tasklist taskrunqueue;
-	int nstalled;
-	/* end locked */
+	/* placement; set once at initialization, see libtaskmnattr() */
+	int *cpus;
+	int *cpunode;  /* node of cpus[i] */
+	int *cpuload;  /* live workers pinned to cpus[i]; under ctllock */
+	int ncpu;
+	int nnode;
+	int stealorder[MAXNODE][MAXNODE];  /* other nodes, nearest first */
 
-	/* threadpool management; protected by blockedth.l */
-	struct Rendez blockedth __aligned(64);
-	int curthr;
-	int nthr;
-	int nblocking;
-#define LT_BLOCKED_THRESH 75/* percent */
-	/* end locked */
+	/* scheduling domains; entries below npool are set up once */
+	Pool pools[MAXPOOL];
+	int npool;  /* atomic; written under ctllock */
+
+	/* protects pool creation, dumpon and monitoron */
+	pthread_mutex_t ctllock;
+
+	int nworkerid;  /* atomic; next taskworker() id */
+	/* worker threads that may still touch us; see libtaskmnattr() */
+	pthread_mutex_t livelock;
+	pthread_cond_t nolive;
+	int nlive;
+	uvlong tickmult;  /* ns per cputicks(), 32.32 fixed point */
+
+	/* taskdumpsignal() */
+	pthread_t dumper;
+	int dumpon;
+	int dumpfd;
+	int dumppipe[2];
+
+	/* preemption; see taskpoolslice() */
+	Worker *workers;  /* lock-free push, never unlinked */
+	pthread_t monitor;
+	int monitoron;  /* protected by ctllock */
+	int monitorexit;
+
+	/* idle stack trimming; see taskstacktrim() */
+	uvlong trimns;  /* atomic; 0 means off */
+	uvlong trimlast;  /* fdtask only */
+	uvlong stacktrimmed;  /* atomic */
+
+	/* stack profile; see taskstackprof() */
+	int stackprof;  /* atomic; paint new stacks */
+	pthread_mutex_t stackproflock;
+	Stackname *stacknames;  /* protected by stackproflock */
+	int nstackname;
+	int nstackscan;  /* see stackscanbegin(); set under stackproflock */
+	Task *stackdefer;  /* exited during a scan, linked by next */
+
+	/* task-local storage; see taskkeycreate() */
+	int nkey;  /* atomic; may overshoot MAXTASKKEY */
+	void (*keydtor[MAXTASKKEY])(void*);  /* set once per key */
 };
 
+static inline Pool*
+poolof(Task *t)
+{
+	return &t->ltcontext->pools[t->pool];
+}
+
+static inline void
+cpurelax(void)
+{
+	__asm__ __volatile__("pause" ::: "memory");
+}
+
+/* cheap timestamp for accounting; see ticksns() for the unit */
+static inline uvlong
+cputicks(void)
+{
+	uint lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uvlong)hi<<32 | lo;
+}
+
 static inline void
 slocksx(pthread_rwlock_t *l)
 {
@@ -230,3 +499,146 @@ condnotify(pthread_cond_t *c)
 	r = pthread_cond_signal(c);
 	ASSERT(r==0, "%s: %s", __func__, strerror(r));
 }
+
+static inline void
+condnotifyall(pthread_cond_t *c)
+{
+	int r;
+	r = pthread_cond_broadcast(c);
+	ASSERT(r==0, "%s: %s", __func__, strerror(r));
+}
+
+/*
+ * Lock profiling. Built with -DLOCKPROF, the wrappers above become macros
+ * that tag every acquisition with a static Locksite for its call site.
+ * Sites record acquisitions, contended acquisitions, and wait and hold
+ * time, but only while tasklockprof() has it switched on. Hold time is
+ * charged to the site that took the lock; see lockprof.c.
+ */
+typedef struct Locksite Locksite;
+
+struct Locksite
+{
+	char	*file;
+	int	line;
+	char	*op;
+	char	*lock;	/* the lock expression, as written */
+	uvlong	nacq;
+	uvlong	ncontended;
+	uvlong	waitticks;
+	uvlong	maxwait;
+	uvlong	holdticks;
+	uvlong	maxhold;
+	int	registered;
+	Locksite *next;
+};
+
+extern int	lockprofon;
+extern __thread int	lockprofnheld;	/* entries on this thread's held stack */
+void	lockprofacquired(void *l, Locksite*, uvlong wait, bool contended);
+void	lockprofreleased(void *l);
+
+#ifdef LOCKPROF
+
+static inline void
+proflockmtx(pthread_mutex_t *l, Locksite *s)
+{
+	uvlong t0;
+
+	if(!lockprofon){
+		lockmtx(l);
+		return;
+	}
+	if(trymtx(l)){
+		lockprofacquired(l, s, 0, false);
+		return;
+	}
+	t0 = cputicks();
+	lockmtx(l);
+	lockprofacquired(l, s, cputicks() - t0, true);
+}
+
+static inline bool
+proftrymtx(pthread_mutex_t *l, Locksite *s)
+{
+	if(!trymtx(l))
+		return false;
+	if(lockprofon)
+		lockprofacquired(l, s, 0, false);
+	return true;
+}
+
+static inline void
+profunlockmtx(pthread_mutex_t *l)
+{
+	if(lockprofnheld)
+		lockprofreleased(l);
+	unlockmtx(l);
+}
+
+static inline void
+profslocksx(pthread_rwlock_t *l, Locksite *s)
+{
+	uvlong t0;
+
+	if(!lockprofon){
+		slocksx(l);
+		return;
+	}
+	if(pthread_rwlock_tryrdlock(l) == 0){
+		lockprofacquired(l, s, 0, false);
+		return;
+	}
+	t0 = cputicks();
+	slocksx(l);
+	lockprofacquired(l, s, cputicks() - t0, true);
+}
+
+static inline void
+profxlocksx(pthread_rwlock_t *l, Locksite *s)
+{
+	uvlong t0;
+
+	if(!lockprofon){
+		xlocksx(l);
+		return;
+	}
+	if(pthread_rwlock_trywrlock(l) == 0){
+		lockprofacquired(l, s, 0, false);
+		return;
+	}
+	t0 = cputicks();
+	xlocksx(l);
+	lockprofacquired(l, s, cputicks() - t0, true);
+}
+
+static inline void
+profunlocksx(pthread_rwlock_t *l)
+{
+	if(lockprofnheld)
+		lockprofreleased(l);
+	unlocksx(l);
+}
+
+/* the wait itself isn't contention; just end the hold and start another */
+static inline void
+profcondwaittime(pthread_cond_t *c, pthread_mutex_t *l, unsigned ms,
+    Locksite *s)
+{
+	if(lockprofnheld)
+		lockprofreleased(l);
+	condwaittime(c, l, ms);
+	if(lockprofon)
+		lockprofacquired(l, s, 0, false);
+}
+
+#define LOCKSITE(l, o)	({ static Locksite _ls = { __FILE__, __LINE__, o, #l }; &_ls; })
+#define lockmtx(l)	proflockmtx((l), LOCKSITE(l, "lock"))
+#define trymtx(l)	proftrymtx((l), LOCKSITE(l, "trylock"))
+#define unlockmtx(l)	profunlockmtx(l)
+#define slocksx(l)	profslocksx((l), LOCKSITE(l, "rlock"))
+#define xlocksx(l)	profxlocksx((l), LOCKSITE(l, "wlock"))
+#define unlocksx(l)	profunlocksx(l)
+#define condwaittime(c, l, ms)	profcondwaittime((c), (l), (ms), LOCKSITE(l, "condwait"))
+
+#endif
@@ -15,8 +15,12 @@ extern "C" {
 	__attribute__((__format__ (__printf__, fmtarg, firstvararg)))
 #endif
 
+#include <sys/types.h>
+
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 typedef struct Libtaskcontext ltctx;
 typedef struct Task Task;
@@ -31,13 +35,168 @@ typedef struct Tasklist Tasklist;
  * returns with the error code that the last task to exit returns.
  */
 int		libtaskmn(void (*f)(Task *lt, void *arg), void *arg, int nthr);
+
+/*
+ * libtaskmnattr() is libtaskmn() with placement options. With ncpu > 0,
+ * each worker is pinned to the entry of cpus with the fewest live
+ * workers on it, so workers respawned by a resize or started for a new
+ * pool spread out like the first ones did. With numa set, workers are
+ * grouped by the node of their CPU (every CPU we may run on, if ncpu is
+ * 0): each node gets its own run queue, tasks are queued on the node they
+ * last ran on, and an idle worker takes work from its own node before
+ * stealing from the nearest other one. Task stacks are preferentially
+ * placed on the creating worker's node.
+ */
+typedef struct Taskpoolattr Taskpoolattr;
+
+struct Taskpoolattr
+{
+	int	nthr;
+	int	*cpus;
+	int	ncpu;
+	int	numa;
+};
+
+int		libtaskmnattr(void (*f)(Task *lt, void *arg), void *arg,
+		    Taskpoolattr *attr);
 void		taskpoolsize(Task *, int);
 
+/*
+ * Scheduling domains. The context starts with one pool, "main" (id 0).
+ * taskpoolcreate() adds another with its own nthr worker threads and run
+ * queues and returns its id, or -1 if the name is taken, longer than
+ * 31 bytes, or there are already eight. A task only runs on its pool's
+ * workers; new tasks start in their creator's pool. taskmigrate() moves
+ * the calling task to pool and returns once it is running there, with
+ * the id of the pool it left, so heavy work can hop off the
+ * latency-sensitive workers and back:
+ *
+ *	old = taskmigrate(t, compute);
+ *	crunch();
+ *	taskmigrate(t, old);
+ *
+ * taskpoolsize() resizes the calling task's pool, taskpoolresize() any.
+ * Pools last as long as the context.
+ */
+int		taskpoolcreate(Task *, char *name, int nthr);
+int		taskpoolfind(Task *, char *name);
+void		taskpoolresize(Task *, int pool, int nthr);
+int		taskgetpool(Task *);
+int		taskmigrate(Task *, int pool);
+
+/*
+ * Preemption. taskpoolslice() sets the time slice of the calling task's
+ * pool. Once one is set, a monitor thread flags any task in that pool
+ * that has run for longer than usec without switching out while others
+ * in the pool wait for a worker. A flagged task yields at its next safe
+ * point: taskpreemptpoint(), or the fd, channel and fork-join calls that
+ * check it on entry. Tasks are never interrupted asynchronously, since
+ * they may be holding locks the scheduler cannot see. usec 0 (the
+ * default) turns slicing off. taskpreemptpoint() returns 1 if it yielded.
+ */
+void		taskpoolslice(Task *, unsigned int usec);
+int		taskpreemptpoint(Task *);
+
+/*
+ * Idle stack trimming. With ms nonzero, the fd poller periodically hands
+ * back to the kernel the stack pages below the stack pointer of any task
+ * that has sat in fdwait() or taskdelay() for more than ms milliseconds.
+ * 0 (the default) turns it off.
+ */
+void		taskstacktrim(Task *, unsigned int ms);
+
+/*
+ * Scheduler accounting. Every dispatch is timestamped with the cycle
+ * counter, so this is always on. taskstat() reports on one task (itself,
+ * or a taskspawn() handle not yet joined): time spent running, time spent
+ * runnable but waiting for a worker, and how often it was dispatched.
+ * taskpoolstat() sums the per-worker histograms; bucket i counts samples
+ * of [2^i, 2^(i+1)) nanoseconds, the last bucket everything longer.
+ */
+enum
+{
+	TASKHIST = 32
+};
+
+typedef struct Taskstat Taskstat;
+typedef struct Poolstat Poolstat;
+
+struct Taskstat
+{
+	uint64_t	runns;
+	uint64_t	waitns;
+	uint64_t	ndispatch;
+};
+
+struct Poolstat
+{
+	uint64_t	ndispatch;
+	uint64_t	qlat[TASKHIST];	/* ready to running */
+	uint64_t	slice[TASKHIST];	/* running to switched out */
+	uint64_t	stacktrimmed;	/* bytes released by taskstacktrim() */
+};
+
+void		taskstat(Task *, Taskstat *);
+void		taskpoolstat(Task *, Poolstat *);
+
+/*
+ * Introspection. taskdump() writes one line per task to fd: id, what it
+ * is doing (running, ready, or what it waits on), for how long, stack in
+ * use, and its name and state strings. Tasks keep running; the table is
+ * copied under the scheduler lock and formatted afterwards.
+ * taskdumpsignal() arranges for a dump to fd whenever the process gets
+ * sig. The dump is written by a helper thread, so it works even when
+ * every worker is stuck.
+ */
+void		taskdump(Task *, int fd);
+void		taskdumpsignal(Task *, int sig, int fd);
+
+/*
+ * Lock contention profile of the library's internal locks. Only available
+ * when built with -DLOCKPROF; otherwise tasklockprof() does nothing and
+ * tasklockprofdump() says so. Switching the profiler on starts a fresh
+ * window. The dump lists, per lock and then per call site, acquisitions,
+ * contended acquisitions, and total and worst wait and hold times.
+ */
+void		tasklockprof(Task *, int on);
+void		tasklockprofdump(Task *, int fd);
+
+/*
+ * Stack usage profile. While taskstackprof() has it on, new task stacks
+ * are painted with a canary pattern; when a painted task exits, the
+ * deepest point it reached is recorded under its taskname(). The dump
+ * lists, per name, how many tasks there were and their deepest and mean
+ * stack use, counting live painted tasks as they are now. Switching the
+ * profile on starts a fresh window. Painting touches the whole stack, so
+ * it costs memory and time at taskcreate(); leave it off in production.
+ */
+void		taskstackprof(Task *, int on);
+void		taskstackprofdump(Task *, int fd);
+
 /*
  * basic procs and threads
  */
 
 int		taskcreate(Task *, void (*f)(Task *t, void *arg), void *arg);
+
+/*
+ * Priority classes. Runnable tasks queue per class and the highest
+ * non-empty class runs first, except that a class passed over too many
+ * dispatches in a row is served next so nothing starves. taskcreate()
+ * uses TASKPRIONORMAL; tasksetprio() changes the calling task's class
+ * from the next time it is queued.
+ */
+enum
+{
+	TASKPRIOHIGH,	/* latency-critical: control plane, health checks */
+	TASKPRIONORMAL,
+	TASKPRIOLOW,	/* batch */
+	TASKNPRIO
+};
+int		taskcreateprio(Task *, int prio, void (*f)(Task *t, void *arg),
+		    void *arg);
+void		tasksetprio(Task *, int prio);
+int		taskprio(Task *);
 void**		taskdata(Task *);
 unsigned int	taskdelay(Task *, unsigned int ms);
 void		taskexit(Task *, int);
@@ -49,6 +208,60 @@ void		taskstate(Task *, char*, ...) __printflike(2, 3);
 void		tasksystem(Task *);
 int		taskyield(Task *);
 
+/*
+ * Joinable tasks. taskspawn() is taskcreate() for a function with a result;
+ * the returned handle must be passed to taskjoin() exactly once, which
+ * sleeps until the task finishes, returns f's result (nil if it called
+ * taskexit()) and releases the handle. taskjoinall() joins n handles and
+ * stores their results in result[] (if non-nil).
+ */
+Task*		taskspawn(Task *, void *(*f)(Task *t, void *arg), void *arg);
+void*		taskjoin(Task *, Task *);
+void		taskjoinall(Task *, Task **, int n, void **result);
+
+/*
+ * Call fn(arg) on the current worker thread's own stack (at least
+ * 8 MiB) instead of the task's, and return its result. For deep but
+ * self-contained library calls: regex compilation, compression,
+ * getaddrinfo. fn runs to completion on this worker; it must not call
+ * anything that may yield or block in taskmn.
+ */
+void*		taskcallbig(Task *, void *(*fn)(void *arg), void *arg);
+
+/*
+ * Per-task arena. taskmalloc() returns 16-byte aligned memory that lives
+ * until the task exits or resets its arena; there is no free. Memory is
+ * carved out of chunks cached per worker thread, so it rarely touches the
+ * global heap. taskarenamark() records the arena's current extent and
+ * taskarenareset() releases everything allocated since that mark (or
+ * everything, given nil), e.g. at the end of each request. Don't hand
+ * arena memory to another task that may outlive the allocating one.
+ */
+typedef struct Taskmark Taskmark;
+
+struct Taskmark
+{
+	void	*chunk;
+	size_t	used;
+	void	*big;
+};
+
+void*		taskmalloc(Task *, size_t);
+void		taskarenamark(Task *, Taskmark *);
+void		taskarenareset(Task *, Taskmark *);
+
+/*
+ * Task-local storage, keyed like pthread_key_create(). taskkeycreate()
+ * returns a new key for the whole context (or -1 once 256 are in use);
+ * every task starts with nil for it. dtor, if non-nil, is called with each
+ * task's non-nil value when that task exits, on the task's own stack. The
+ * first eight keys live in the Task itself, so libraries should create
+ * theirs once at startup. Access is a plain load or store with no locking.
+ */
+int		taskkeycreate(Task *, void (*dtor)(void *));
+void*		taskgetlocal(Task *, int key);
+void		tasksetlocal(Task *, int key, void *);
+
 /*
  * declare that a section of code may block; taskmn internally prevents
  * some fraction of threads from running blocking sections at any time.
@@ -62,6 +275,14 @@ struct Tasklist	/* used internally */
 	Task	*tail;
 };
 
+typedef struct Waitlist Waitlist;
+
+struct Waitlist	/* used internally */
+{
+	struct Waiter	*head;
+	struct Waiter	*tail;
+};
+
 /*
  * sleep and wakeup (condition variables)
  */
@@ -70,19 +291,218 @@ typedef struct Rendez Rendez;
 struct Rendez
 {
 	pthread_mutex_t	l;
-	Tasklist waiting;
+	Waitlist waiting;
+	struct QLock	*q;	/* see rendezinitq() */
 };
 
 /*
  * Note: Much like pthread conds, caller must lock the rendez lock around
  * tasksleep(). Caller must also lock the rendez lock for calls
  * to taskwakeup() and taskwakeupall();
+ *
+ * For a Rendez set up with rendezinitq(), "the rendez lock" is the QLock;
+ * wakeups then hand sleepers the QLock one at a time instead of waking
+ * them all to fight over it.
  */
 void	rendezinit(Rendez *);
+void	rendezinitq(Rendez *, struct QLock*);
 void	tasksleep(Task *, Rendez*);
+int	tasksleeptimed(Task *, Rendez*, unsigned int ms);
 int	taskwakeup(Rendez*);
 int	taskwakeupall(Rendez*);
 
+/*
+ * Handing work to the pool from threads that are not running a task
+ * (library callbacks, signal-handling threads). A task gets the context
+ * handle with taskcontext(); from then on any thread may call taskpost()
+ * to have f(t, arg) run as a new task, or taskpostwakeup() to have
+ * taskwakeup(r) (all == 0) or taskwakeupall(r) done with r's lock held.
+ * Neither blocks or takes a Task lock: the request goes on a lock-free
+ * inbox that the workers drain, and idle workers are woken only if there
+ * are any. The caller must make sure the pool (and r) outlives the post,
+ * e.g. by keeping a task waiting for it. Once taskcontext() has been
+ * called, every worker idling is no longer treated as a deadlock.
+ */
+ltctx*	taskcontext(Task *);
+void	taskpost(ltctx *, void (*f)(Task *t, void *arg), void *arg);
+void	taskpostwakeup(ltctx *, Rendez *, int all);
+
+/*
+ * Wait for the first of several events. Each Alt names one:
+ *
+ *	ALTSLEEP	a taskwakeup()/taskwakeupall() on r; as with tasksleep(),
+ *			the caller holds the rendez lock, which is released
+ *			while waiting
+ *	ALTREAD		fd readable (as fdwait(fd, 'r'))
+ *	ALTWRITE	fd writable (as fdwait(fd, 'w'))
+ *	ALTTIMER	ms milliseconds elapsed
+ *
+ * taskselect() returns the index of the alternative that fired; the others
+ * are withdrawn before it returns. Every ALTSLEEP lock is held again on
+ * return, reacquired in array order; a QLock shared by several Rendez is
+ * released and retaken once. At most TASKSELECTMAX alternatives; no
+ * Rendez may appear twice.
+ */
+enum
+{
+	ALTSLEEP,
+	ALTREAD,
+	ALTWRITE,
+	ALTTIMER,
+
+	TASKSELECTMAX = 16
+};
+
+typedef struct Alt Alt;
+
+struct Alt
+{
+	int		op;
+	Rendez		*r;
+	int		fd;
+	unsigned int	ms;
+};
+
+int	taskselect(Task*, Alt*, int);
+
+/*
+ * Task-level mutex. Unlike the Rendez lock, a contended qlock() parks the
+ * calling task rather than blocking its worker thread, and qunlock() hands
+ * ownership directly to the next waiter. Initialize with qlockinit().
+ */
+typedef struct QLock QLock;
+
+struct QLock
+{
+	Task	*owner;
+	int	nwaiting;
+	pthread_mutex_t	l;	/* protects waiting; never held across a switch */
+	Tasklist waiting;
+};
+
+void	qlockinit(QLock*);
+void	qlock(Task*, QLock*);
+int	canqlock(Task*, QLock*);
+void	qunlock(Task*, QLock*);
+
+/*
+ * Read-mostly reader/writer lock. Readers only touch a counter picked by
+ * the worker they run on, so uncontended rlock()/runlock() never share a
+ * cache line across workers; writers (serialized on wl) flag themselves
+ * and wait for the counters to drain. Writers are preferred.
+ */
+typedef struct RWLock RWLock;
+
+enum
+{
+	RWLOCKSLOTS = 16
+};
+
+struct RWLock
+{
+	struct {
+		int	n;
+		char	pad[64-sizeof(int)];
+	}	readers[RWLOCKSLOTS];
+	int	writer;
+	Task	*wwait;	/* writer waiting for readers to drain */
+	QLock	wl;
+	pthread_mutex_t	l;	/* protects wwait and rwait */
+	Tasklist rwait;
+};
+
+void	rwlockinit(RWLock*);
+void	rlock(Task*, RWLock*);
+int	canrlock(Task*, RWLock*);
+void	runlock(Task*, RWLock*);
+void	wlock(Task*, RWLock*);
+void	wunlock(Task*, RWLock*);
+
+/*
+ * Counting semaphore, WaitGroup and reusable barrier. All take a single
+ * atomic operation when nobody has to sleep.
+ *
+ * semrelease() hands its permit straight to a sleeping semacquire().
+ * wgwait() sleeps until as many wgdone() calls as wgadd() has counted.
+ * barrierwait() sleeps until n tasks have arrived and returns 1 in exactly
+ * one of them (the last to arrive), 0 in the rest.
+ */
+typedef struct Sem Sem;
+typedef struct WaitGroup WaitGroup;
+typedef struct Barrier Barrier;
+
+struct Sem
+{
+	int	count;
+	int	nwaiting;
+	pthread_mutex_t	l;
+	Tasklist waiting;
+};
+
+struct WaitGroup
+{
+	uint64_t	state;	/* count<<32 | waiters */
+	pthread_mutex_t	l;
+	Tasklist waiting;
+};
+
+struct Barrier
+{
+	int	n;
+	int	count;
+	unsigned int	gen;
+	pthread_mutex_t	l;
+	Tasklist waiting;
+};
+
+void	seminit(Sem*, int);
+void	semacquire(Task*, Sem*);
+int	semtryacquire(Task*, Sem*);
+void	semrelease(Task*, Sem*);
+
+void	wginit(WaitGroup*);
+void	wgadd(WaitGroup*, int);
+void	wgdone(WaitGroup*);
+void	wgwait(Task*, WaitGroup*);
+
+void	barrierinit(Barrier*, int);
+int	barrierwait(Task*, Barrier*);
+
+/*
+ * Bounded channels carrying fixed-size values (elemsize bytes, copied in and
+ * out). bufsize is rounded up to a power of two. chansend() returns 0, or -1
+ * if the channel is closed; chanrecv() returns 1, or 0 once the channel is
+ * closed and drained. The nb variants never sleep and return 1 on success,
+ * 0 if they would have slept, -1 if the channel is closed (and drained).
+ */
+typedef struct Channel Channel;
+
+Channel*	chancreate(int elemsize, int bufsize);
+void		chanfree(Channel*);
+void		chanclose(Task*, Channel*);
+int		chansend(Task*, Channel*, void*);
+int		chanrecv(Task*, Channel*, void*);
+int		channbsend(Task*, Channel*, void*);
+int		channbrecv(Task*, Channel*, void*);
+
+/*
+ * Fork-join loops over [lo, hi). fn is called on consecutive subranges of
+ * at most grain iterations; pieces are split off to other workers only
+ * while some worker is idle. taskparallelfor() returns once every
+ * iteration has run.
+ *
+ * taskparallelreduce() also gives each piece its own accumulator
+ * (accsize bytes, starting as a copy of *acc, which must hold the identity)
+ * and folds them into *acc with combine(acc, other, arg), which must be
+ * associative and commutative.
+ */
+void	taskparallelfor(Task*, long lo, long hi, long grain,
+	    void (*fn)(Task*, long lo, long hi, void *arg), void *arg);
+void	taskparallelreduce(Task*, long lo, long hi, long grain,
+	    void (*fn)(Task*, long lo, long hi, void *acc, void *arg),
+	    void (*combine)(void *acc, void *other, void *arg),
+	    void *acc, size_t accsize, void *arg);
+
 /*
  * Threaded I/O.
  * (Note: a trip through fdwait() is slow -- we only poll when the ready queue
@@ -108,6 +528,20 @@ int		netaccept(Task *, int);
 int		netdial(Task *, int, char*, int);
 int		netlookup(Task *, char*, uint32_t*);	/* blocks entire program! */
 
+/*
+ * Outbound connection pooling. A Netpool caches up to maxidle idle
+ * connections to one destination and caps the number outstanding at maxtotal
+ * (0 for no cap); netpoolget() sleeps while the cap is reached. Idle
+ * connections older than idlems are closed by a reaper task.
+ */
+typedef struct Netpool Netpool;
+
+Netpool*	netpoolcreate(Task *, int, char*, int, int maxidle, int maxtotal,
+		    unsigned int idlems);
+int		netpoolget(Task *, Netpool*);
+void		netpoolput(Task *, Netpool*, int fd, int reuse);
+void		netpoolfree(Task *, Netpool*);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,112 @@
+#include "taskimpl.h"
+
+/*
+ * Task-local storage. Keys are small integers handed out per context and
+ * never reused. The first TASKLOCALINLINE slots live in the Task itself;
+ * the rest go in an array hung off it, grown on the first store past its
+ * end, so a lookup is an index either way. Destructors run on the task's
+ * own stack from taskexit(), before the task switches out for the last
+ * time, so they may do anything a task can.
+ */
+
+enum
+{
+	LOCALPASSES = 4	/* as PTHREAD_DESTRUCTOR_ITERATIONS */
+};
+
+int
+taskkeycreate(Task *t, void (*dtor)(void*))
+{
+	ltctx *lt = t->ltcontext;
+	int k;
+
+	k = __atomic_fetch_add(&lt->nkey, 1, __ATOMIC_RELAXED);
+	if(k >= MAXTASKKEY){
+		__atomic_store_n(&lt->nkey, MAXTASKKEY, __ATOMIC_RELAXED);
+		return -1;
+	}
+	__atomic_store_n(&lt->keydtor[k], dtor, __ATOMIC_RELEASE);
+	return k;
+}
+
+static void**
+slot(Task *t, int k)
+{
+	if(k < TASKLOCALINLINE)
+		return &t->local[k];
+	k -= TASKLOCALINLINE;
+	return k < t->nlocalmore ? &t->localmore[k] : nil;
+}
+
+void*
+taskgetlocal(Task *t, int k)
+{
+	void **p;
+
+	ASSERT(k >= 0 && k < MAXTASKKEY, "taskgetlocal: bad key %d", k);
+	p = slot(t, k);
+	return p ? *p : nil;
+}
+
+void
+tasksetlocal(Task *t, int k, void *v)
+{
+	void **p;
+	int n;
+
+	ASSERT(k >= 0 && k < MAXTASKKEY, "tasksetlocal: bad key %d", k);
+	if((p = slot(t, k)) == nil){
+		if(v == nil)
+			return;
+		/* room for every key created so far */
+		n = __atomic_load_n(&t->ltcontext->nkey, __ATOMIC_RELAXED);
+		if(n > MAXTASKKEY)
+			n = MAXTASKKEY;
+		n -= TASKLOCALINLINE;
+		ASSERT(n > k - TASKLOCALINLINE, "tasksetlocal: bad key %d", k);
+		p = realloc(t->localmore, n * sizeof p[0]);
+		ASSERT(p, "oom");
+		memset(p + t->nlocalmore, 0, (n - t->nlocalmore) * sizeof p[0]);
+		t->localmore = p;
+		t->nlocalmore = n;
+		p = slot(t, k);
+	}
+	*p = v;
+}
+
+/*
+ * Called by taskexit(). Like pthread keys: each non-nil value is cleared
+ * and then passed to its key's destructor; destructors that store new
+ * values get a few more passes to clear those too.
+ */
+void
+localexit(Task *t)
+{
+	ltctx *lt = t->ltcontext;
+	void (*dtor)(void*);
+	void **p, *v;
+	int i, k, n, again;
+
+	n = TASKLOCALINLINE + t->nlocalmore;
+	for(i=0; i<LOCALPASSES; i++){
+		again = 0;
+		for(k=0; k<n; k++){
+			p = slot(t, k);
+			if((v = *p) == nil)
+				continue;
+			*p = nil;
+			dtor = __atomic_load_n(&lt->keydtor[k], __ATOMIC_ACQUIRE);
+			if(dtor){
+				dtor(v);
+				again = 1;
+			}
+			/* a destructor may have grown the overflow array */
+			n = TASKLOCALINLINE + t->nlocalmore;
+		}
+		if(!again)
+			break;
+	}
+	free(t->localmore);
+	t->localmore = nil;
+	t->nlocalmore = 0;
+}